@@ -2,13 +2,18 @@
 
 #include <kernel/mem/boot.h>
 #include <kernel/mem/buddy.h>
+#include <kernel/mem/compact.h>
 #include <kernel/mem/dump.h>
+#include <kernel/mem/idle.h>
 #include <kernel/mem/init.h>
 #include <kernel/mem/insert.h>
 #include <kernel/mem/lookup.h>
 #include <kernel/mem/map.h>
+#include <kernel/mem/page.h>
 #include <kernel/mem/ptbl.h>
 #include <kernel/mem/remove.h>
+#include <kernel/mem/slab.h>
+#include <kernel/mem/thp.h>
 #include <kernel/mem/tlb.h>
 #include <kernel/mem/walk.h>
 
@@ -6,7 +6,20 @@
 
 #include <x86-64/memory.h>
 
-#define BUDDY_MAX_ORDER (BUDDY_2M_PAGE + 1)
+/* Chunks go up to 1G, such that a free chunk can back a 1G page. */
+#define BUDDY_MAX_ORDER (BUDDY_1G_PAGE + 1)
+
+/*
+ * The struct page_info array is mapped and initialized in sections of
+ * 2^BUDDY_SECTION_ORDER pages.
+ */
+#define BUDDY_SECTION_ORDER BUDDY_2M_PAGE
+#define BUDDY_SECTION_PAGES (1 << BUDDY_SECTION_ORDER)
+
+/* The number of pages backing the struct page_info structs of a section. */
+#define BUDDY_SECTION_NALLOC \
+	((BUDDY_SECTION_PAGES * sizeof(struct page_info) + PAGE_SIZE - 1) / \
+	 PAGE_SIZE)
 
 extern struct page_info *pages;
 extern size_t npages;
@@ -43,6 +56,48 @@ enum {
 	ALLOC_ZERO = 1 << 0,
 	ALLOC_HUGE = 1 << 1,
 	ALLOC_PREMAPPED = 1 << 2,
+	/* The page can be migrated, e.g. a page that is only mapped by PTEs. */
+	ALLOC_MOVABLE = 1 << 3,
+	/* The page can be given back on request, e.g. a slab page. */
+	ALLOC_RECLAIMABLE = 1 << 4,
+	/* Fail rather than compact memory if no free huge page is left. */
+	ALLOC_NOCOMPACT = 1 << 5,
+};
+
+/*
+ * The mobility types. Free memory is grouped into pageblocks of
+ * 2^PAGEBLOCK_ORDER pages, each of which serves allocations of one mobility
+ * type, such that pages that cannot be migrated do not end up scattered over
+ * all of memory.
+ */
+enum {
+	MIGRATE_MOVABLE = 0,
+	MIGRATE_UNMOVABLE,
+	MIGRATE_RECLAIMABLE,
+	MIGRATE_TYPES,
+};
+
+#define PAGEBLOCK_ORDER BUDDY_2M_PAGE
+#define PAGEBLOCK_PAGES (1 << PAGEBLOCK_ORDER)
+
+/* Flags for the pp_flags field of struct page_info. */
+enum {
+	/* Set on the first page of a section of which the other struct
+	 * page_info structs have not been initialized yet.
+	 */
+	PP_UNINIT = 1 << 0,
+
+	/* Set on the first page of a free chunk that has been cleared. */
+	PP_ZERO = 1 << 1,
+
+	/* Set on pages that are used as a slab by a struct kmem_cache. */
+	PP_SLAB = 1 << 2,
+
+	/* The mobility type (MIGRATE_*) of a pageblock, stored on the first
+	 * page of the pageblock.
+	 */
+	PP_MIGRATE_SHIFT = 3,
+	PP_MIGRATE_MASK = 3 << PP_MIGRATE_SHIFT,
 };
 
 /* The buddy allocator order for known page sizes. */
@@ -56,11 +111,22 @@ size_t count_free_pages(size_t order);
 void show_buddy_info(void);
 size_t count_total_free_pages(void);
 struct page_info *page_alloc(int alloc_flags);
+struct page_info *page_alloc_order(size_t order, int alloc_flags);
 struct page_info *buddy_find(size_t req_order);
+size_t buddy_zero_idle(void);
+size_t page_alloc_bulk(int alloc_flags, struct page_info **array, size_t n);
 void page_free(struct page_info *pp);
+void page_free_bulk(struct page_info **array, size_t n);
+void buddy_free_chunk(struct page_info *page, size_t order);
+void buddy_isolate(struct page_info *page);
+void page_cache_drain(void);
+bool page_cache_enable(bool enable);
 void page_decref(struct page_info *pp);
+void buddy_init_section(struct page_info *page);
+void buddy_init_idle(void);
 void buddy_migrate(void);
 int buddy_map_chunk(struct page_table *pml4, size_t index);
+uint64_t buddy_map_bulk_savings(void);
 
 static inline physaddr_t page2pa(struct page_info *pp)
 {
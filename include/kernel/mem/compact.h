@@ -0,0 +1,9 @@
+#pragma once
+
+#include <types.h>
+
+extern bool compact_on_demand;
+extern size_t compact_max_migrate;
+
+int compact_memory(void);
+void show_compact_info(void);
@@ -0,0 +1,3 @@
+#pragma once
+
+void mem_idle(void);
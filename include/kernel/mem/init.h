@@ -7,6 +7,8 @@
 #include <x86-64/memory.h>
 
 extern struct page_table *kernel_pml4;
+extern bool gpage_supported;
+extern bool pcid_supported;
 
 void mem_init(struct boot_info *boot_info);
 void page_init(struct boot_info *boot_info);
@@ -3,6 +3,10 @@
 #include <types.h>
 #include <paging.h>
 
+physaddr_t *lookup_entry(struct page_table *pml4, void *va);
+void lookup_cache_invalidate(struct page_table *pml4, uintptr_t start,
+	uintptr_t end);
 struct page_info *page_lookup(struct page_table *pml4, void *va,
 	physaddr_t **entry_store);
 
+void lookup_benchmark(size_t npages, size_t rounds);
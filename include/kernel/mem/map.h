@@ -1,10 +1,14 @@
 #pragma once
 
 #include <types.h>
+#include <boot.h>
 #include <elf.h>
 #include <paging.h>
 
+extern physaddr_t boot_map_lim;
+
 void boot_map_region(struct page_table *pml4, void *va, size_t size,
     physaddr_t pa, uint64_t flags);
 void boot_map_kernel(struct page_table *pml4, struct elf *elf_hdr);
+void boot_map_physmem(struct page_table *pml4, struct boot_info *boot_info);
 
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <types.h>
+#include <paging.h>
+
+#include <kernel/mem/buddy.h>
+
+#define page_list_foreach(list, page) \
+	for (page = page_list_first(list); page; page = page_list_next(page))
+
+static inline struct page_info *idx2page(uint32_t idx)
+{
+	return (idx == PAGE_LIST_NIL) ? NULL : pages + idx;
+}
+
+static inline int page_list_is_empty(struct page_list *list)
+{
+	return list->first == PAGE_LIST_NIL;
+}
+
+static inline struct page_info *page_list_first(struct page_list *list)
+{
+	return idx2page(list->first);
+}
+
+static inline struct page_info *page_list_last(struct page_list *list)
+{
+	return idx2page(list->last);
+}
+
+static inline struct page_info *page_list_next(struct page_info *page)
+{
+	return idx2page(page->pp_next);
+}
+
+static inline struct page_info *page_list_prev(struct page_info *page)
+{
+	return idx2page(page->pp_prev);
+}
+
+/* Returns whether the page is on a page list. */
+static inline int page_on_list(struct page_info *page)
+{
+	return page->pp_next != (uint32_t)(page - pages);
+}
+
+void page_list_init(struct page_list *list);
+void page_node_init(struct page_info *page);
+void page_list_add(struct page_list *list, struct page_info *page);
+void page_list_add_tail(struct page_list *list, struct page_info *page);
+void page_list_del(struct page_list *list, struct page_info *page);
+
+void clear_page(void *kva);
+void clear_huge_page(void *kva);
+void copy_page(void *dst, const void *src);
+void copy_huge_page(void *dst, const void *src);
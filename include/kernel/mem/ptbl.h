@@ -3,14 +3,31 @@
 #include <types.h>
 #include <paging.h>
 
+struct page_info;
 struct page_walker;
 
+extern size_t ptbl_pages;
+
+/* The walker->udata for ptbl_merge(). */
+struct ptbl_merge_info {
+	/* The PML4 the page table belongs to, used to flush the TLB. */
+	struct page_table *pml4;
+	/* The flags to allocate the huge page with if the pages have to be
+	 * copied.
+	 */
+	int alloc_flags;
+	/* Whether the pages may be copied, or only promoted in place. */
+	bool may_copy;
+	/* Set by ptbl_merge() if the pages have to be copied. */
+	bool copy;
+};
+
 int ptbl_alloc(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker);
 int ptbl_split(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker);
-int ptbl_merge(physaddr_t *entry, uintptr_t base, uintptr_t end,
+int pdir_split(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker);
-int ptbl_free(physaddr_t *entry, uintptr_t base, uintptr_t end,
+int ptbl_merge(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker);
-
+struct page_info *ptbl_detach(physaddr_t *entry);
@@ -3,7 +3,11 @@
 #include <types.h>
 #include <paging.h>
 
-void unmap_page_range(struct page_table *pml4, void *va, size_t size);
-void unmap_user_pages(struct page_table *pml4);
-void page_remove(struct page_table *pml4, void *va);
+struct mmu_gather;
+
+int unmap_page_range_tlb(struct mmu_gather *tlb, void *va, size_t size,
+    size_t max_span);
+int unmap_page_range(struct page_table *pml4, void *va, size_t size);
+int unmap_user_pages(struct page_table *pml4);
+int page_remove(struct page_table *pml4, void *va);
 
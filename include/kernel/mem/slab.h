@@ -0,0 +1,50 @@
+#pragma once
+
+#include <types.h>
+#include <paging.h>
+
+/* The maximum number of object caches. */
+#define KMEM_MAX_CACHES 32
+
+/* The number of objects a magazine can hold. */
+#define KMEM_MAGAZINE_SIZE 16
+
+/* kmalloc() serves sizes from 2^KMALLOC_MIN_ORDER up to 2^KMALLOC_MAX_ORDER
+ * bytes from object caches, and larger sizes from the buddy allocator.
+ */
+#define KMALLOC_MIN_ORDER 3
+#define KMALLOC_MAX_ORDER 11
+
+/* A stack of free objects that can be handed out without touching the slabs. */
+struct kmem_magazine {
+	size_t count;
+	void *objs[KMEM_MAGAZINE_SIZE];
+};
+
+/*
+ * An object cache hands out objects of a fixed size carved from slabs, where
+ * every slab is a single page. The slabs are kept on a list depending on
+ * whether none, some or all of their objects are allocated.
+ */
+struct kmem_cache {
+	const char *name;
+	size_t obj_size;
+	size_t nobjs;
+	struct page_list empty, partial, full;
+	size_t nslabs;
+	/* The number of objects taken from the slabs, including the objects
+	 * that are sitting in the magazine.
+	 */
+	size_t nactive;
+	struct kmem_magazine magazine;
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+	size_t align);
+void *kmem_cache_alloc(struct kmem_cache *cache, int alloc_flags);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+void kmem_cache_shrink(struct kmem_cache *cache);
+void kmem_init(void);
+void *kmalloc(size_t size, int alloc_flags);
+void kfree(void *obj);
+void show_kmem_info(void);
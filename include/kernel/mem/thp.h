@@ -0,0 +1,10 @@
+#pragma once
+
+#include <types.h>
+
+extern bool thp_enabled;
+extern size_t thp_scan_batch;
+extern size_t thp_npromoted, thp_ndemoted;
+
+size_t thp_idle(void);
+void show_thp_info(void);
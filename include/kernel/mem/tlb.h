@@ -3,5 +3,45 @@
 #include <types.h>
 #include <paging.h>
 
-void tlb_invalidate(struct page_table *pml4, void *va);
+/* The number of pages that an mmu_gather holds on to until it flushes. */
+#define TLB_GATHER_PAGES 64
+
+/*
+ * Collects the TLB invalidations and the pages to be released while unmapping
+ * or replacing pages, such that the TLB only gets flushed once, and the pages
+ * only get released after the flush, when no stale TLB entry can point to
+ * them anymore.
+ */
+struct mmu_gather {
+	struct page_table *pml4;
+	/* The range [start, end] to invalidate, or start > end if empty. */
+	uintptr_t start, end;
+	/* The size of the smallest page in the range. */
+	size_t stride;
+	/* Set if a page table of the kernel half has been detached. */
+	bool flush_global;
+	size_t npages;
+	struct page_info *pages[TLB_GATHER_PAGES];
+};
+
+/* The number of PCIDs handed out to PML4s, including the unused PCID 0. */
+#define PCID_COUNT 64
 
+/* The user address at which the TLB benchmark maps its pages. */
+#define TLB_BENCH_BASE 0x10000000
+
+extern size_t tlb_flush_ceiling;
+
+void tlb_switch_pml4(struct page_table *pml4);
+void tlb_release_pml4(struct page_table *pml4);
+void tlb_flush_global(void);
+void tlb_invalidate(struct page_table *pml4, void *va);
+void tlb_flush_range(struct page_table *pml4, uintptr_t start, uintptr_t end,
+	size_t stride);
+void tlb_gather_init(struct mmu_gather *tlb, struct page_table *pml4);
+void tlb_gather_range(struct mmu_gather *tlb, uintptr_t va, size_t size);
+void tlb_gather_page(struct mmu_gather *tlb, struct page_info *page);
+void tlb_gather_table(struct mmu_gather *tlb, uintptr_t va,
+	struct page_info *table);
+void tlb_gather_flush(struct mmu_gather *tlb);
+void tlb_benchmark(size_t npages, size_t rounds);
@@ -5,6 +5,36 @@
 
 struct page_walker;
 
+/* Given an address addr, this function returns the sign extended address. */
+static __always_inline uintptr_t sign_extend(uintptr_t addr)
+{
+	return (addr < USER_LIM) ? addr : (0xffff000000000000ull | addr);
+}
+
+/* Given an addresss addr, this function returns the page boundary. */
+static __always_inline uintptr_t ptbl_end(uintptr_t addr)
+{
+	return addr | (PAGE_SIZE - 1);
+}
+
+/* Given an address addr, this function returns the page table boundary. */
+static __always_inline uintptr_t pdir_end(uintptr_t addr)
+{
+	return addr | (PAGE_TABLE_SPAN - 1);
+}
+
+/* Given an address addr, this function returns the page directory boundary. */
+static __always_inline uintptr_t pdpt_end(uintptr_t addr)
+{
+	return addr | (PAGE_DIR_SPAN - 1);
+}
+
+/* Given an address addr, this function returns the PDPT boundary. */
+static __always_inline uintptr_t pml4_end(uintptr_t addr)
+{
+	return addr | (PDPT_SPAN - 1);
+}
+
 typedef int (* map_pte_t)(physaddr_t *, uintptr_t, uintptr_t,
     struct page_walker *);
 
@@ -13,10 +43,156 @@ struct page_walker {
 	map_pte_t pte_unmap, pde_unmap, pdpte_unmap, pml4e_unmap;
 	int (* pt_hole_callback)(uintptr_t, uintptr_t, struct page_walker *);
 	void *udata;
+	/* Only visit the present entries and report adjacent holes as a single
+	 * range to pt_hole_callback().
+	 */
+	bool present_only;
+	/* The hole that a present-only walk has not reported yet. */
+	bool hole_pending;
+	uintptr_t hole_base, hole_end;
 };
 
+typedef int (* walk_hole_t)(uintptr_t, uintptr_t, struct page_walker *);
+
+/* Returns the index of the first present entry in [idx, last] of the page
+ * table, or last + 1 if there is none. Once aligned, the entries are scanned a
+ * cache line, i.e. eight entries, at a time by or-ing them together.
+ */
+static __always_inline size_t walk_next_present(struct page_table *table,
+    size_t idx, size_t last)
+{
+	physaddr_t *entries = table->entries;
+
+	for (; idx <= last && (idx & 7); ++idx) {
+		if (entries[idx] & PAGE_PRESENT)
+			return idx;
+	}
+
+	for (; idx + 7 <= last; idx += 8) {
+		if ((entries[idx] | entries[idx + 1] | entries[idx + 2] |
+		     entries[idx + 3] | entries[idx + 4] | entries[idx + 5] |
+		     entries[idx + 6] | entries[idx + 7]) & PAGE_PRESENT)
+			break;
+	}
+
+	for (; idx <= last; ++idx) {
+		if (entries[idx] & PAGE_PRESENT)
+			return idx;
+	}
+
+	return idx;
+}
+
+/* Reports the pending hole, if any, to the hole callback. */
+static __always_inline int walk_hole_flush(struct page_walker *walker,
+    walk_hole_t hole)
+{
+	if (!walker->hole_pending)
+		return 0;
+
+	walker->hole_pending = false;
+
+	return hole(walker->hole_base, walker->hole_end, walker);
+}
+
+/* Adds the hole [base, end] to the pending hole if the two are adjacent.
+ * Otherwise the pending hole is reported first.
+ */
+static __always_inline int walk_hole_extend(struct page_walker *walker,
+    walk_hole_t hole, uintptr_t base, uintptr_t end)
+{
+	int res;
+
+	if (walker->hole_pending && walker->hole_end + 1 == base) {
+		walker->hole_end = end;
+		return 0;
+	}
+
+	res = walk_hole_flush(walker, hole);
+
+	if (res < 0)
+		return res;
+
+	walker->hole_pending = true;
+	walker->hole_base = base;
+	walker->hole_end = end;
+
+	return 0;
+}
+
+/* Like walk_hole_extend(), but splits up holes that extend across the
+ * non-canonical hole between USER_LIM and the kernel half.
+ */
+static __always_inline int walk_hole_add(struct page_walker *walker,
+    walk_hole_t hole, uintptr_t base, uintptr_t end)
+{
+	int res;
+
+	if (!hole)
+		return 0;
+
+	if (base < USER_LIM && end >= USER_LIM) {
+		res = walk_hole_extend(walker, hole, base, USER_LIM - 1);
+
+		if (res < 0 || end < sign_extend(USER_LIM))
+			return res;
+
+		base = sign_extend(USER_LIM);
+	}
+
+	return walk_hole_extend(walker, hole, base, end);
+}
+
+/* Advances next over the entries that are not present in the range [next,
+ * end] of the table, where every entry maps 1 << shift bytes. The skipped range
+ * is added to the pending hole. The walker has to report the pending hole
+ * before it calls any other callback, such that the callbacks are still called
+ * in the order of the addresses.
+ *
+ * If end lies past the table, the remainder of the table is scanned.
+ *
+ * Returns 1 if next now points to a present entry, 0 if there are no present
+ * entries left in the range or the result of the hole callback if it failed.
+ */
+static __always_inline int walk_skip_holes(struct page_table *table,
+    uintptr_t *next, uintptr_t end, unsigned shift,
+    struct page_walker *walker, walk_hole_t hole)
+{
+	uintptr_t table_end = *next | ((UINT64_C(1) << (shift + 9)) - 1);
+	size_t idx = (*next >> shift) & 511, last, i;
+	uintptr_t addr;
+	int res;
+
+	last = (end > table_end) ? 511 : (end >> shift) & 511;
+
+	if (table->entries[idx] & PAGE_PRESENT)
+		return 1;
+
+	i = walk_next_present(table, idx + 1, last);
+
+	if (i > last)
+		return walk_hole_add(walker, hole, *next, end);
+
+	if (i != idx) {
+		addr = ((*next & (USER_LIM * 2 - 1)) &
+			~((UINT64_C(1) << (shift + 9)) - 1)) |
+			((uintptr_t)i << shift);
+		addr = sign_extend(addr);
+		res = walk_hole_add(walker, hole, *next, addr - 1);
+
+		if (res < 0)
+			return res;
+
+		*next = addr;
+	}
+
+	return 1;
+}
+
 int walk_page_range(struct page_table *pml4, void *base, void *end,
 	struct page_walker *walker);
 int walk_all_pages(struct page_table *pml4, struct page_walker *walker);
 int walk_user_pages(struct page_table *pml4, struct page_walker *walker);
 int walk_kernel_pages(struct page_table *pml4, struct page_walker *walker);
+
+void walk_benchmark(size_t rounds);
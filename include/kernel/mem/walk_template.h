@@ -0,0 +1,374 @@
+/*
+ * Generates a page walker that is specialized for a single operation. Rather
+ * than dispatching through the function pointers of struct page_walker, the
+ * generated walker calls the callbacks directly, such that they can be
+ * inlined, and leaves out the checks and the levels for any callback that is
+ * not provided.
+ *
+ * Define WALK_NAME and any of the callbacks below, then include this file:
+ *
+ *	#define WALK_NAME        unmap_walk
+ *	#define WALK_PTE         remove_pte
+ *	#define WALK_PDE_UNMAP   remove_pt
+ *	#include <kernel/mem/walk_template.h>
+ *
+ * This defines:
+ *
+ *	static int unmap_walk(struct page_table *pml4, uintptr_t base,
+ *	    uintptr_t end, struct page_walker *walker);
+ *
+ * that walks over the page aligned range [base, end] like walk_page_range()
+ * does, calling the callbacks with the walker, which only serves to pass on
+ * walker->udata. The callbacks should be declared static __always_inline to
+ * actually get inlined, as the kernel is built with -fno-inline.
+ *
+ * The callbacks are:
+ *  - WALK_PTE, WALK_PDE, WALK_PDPTE and WALK_PML4E for every entry at the
+ *    respective level.
+ *  - WALK_HOLE for every entry that is not present.
+ *  - WALK_PDE_UNMAP, WALK_PDPTE_UNMAP and WALK_PML4E_UNMAP for every present
+ *    entry after walking over the table it points to.
+ *
+ * Defining WALK_PRESENT_ONLY generates a present-only walker instead, as with
+ * walker->present_only: the callbacks are only called for present entries and
+ * WALK_HOLE gets called once for every maximal range of entries that are not
+ * present.
+ *
+ * The macros are undefined at the end, such that the file can be included
+ * again to generate another walker.
+ */
+
+#include <types.h>
+#include <paging.h>
+
+#include <kernel/mem/walk.h>
+
+#ifndef WALK_NAME
+#error "define WALK_NAME before including walk_template.h"
+#endif
+
+#define WALK_CAT_(a, b) a##_##b
+#define WALK_CAT(a, b) WALK_CAT_(a, b)
+#define WALK_FN(level) WALK_CAT(WALK_NAME, level)
+
+#ifdef WALK_HOLE
+#define WALK_HOLE_FN WALK_HOLE
+#else
+#define WALK_HOLE_FN NULL
+#endif
+
+/* Reports the pending hole of a present-only walk, before calling any of the
+ * other callbacks.
+ */
+static __always_inline int WALK_FN(sync)(struct page_walker *walker)
+{
+#if defined(WALK_HOLE) && defined(WALK_PRESENT_ONLY)
+	return walk_hole_flush(walker, WALK_HOLE);
+#else
+	return 0;
+#endif
+}
+
+/* Which levels have to be walked, given the callbacks. */
+#if defined(WALK_PTE) || defined(WALK_HOLE)
+#define WALK_PTBL
+#endif
+
+#if defined(WALK_PTBL) || defined(WALK_PDE) || defined(WALK_PDE_UNMAP)
+#define WALK_PDIR
+#endif
+
+#if defined(WALK_PDIR) || defined(WALK_PDPTE) || defined(WALK_PDPTE_UNMAP)
+#define WALK_PDPT
+#endif
+
+#ifdef WALK_PTBL
+static __always_inline int WALK_FN(ptbl)(struct page_table *ptbl,
+    uintptr_t base, uintptr_t end, struct page_walker *walker)
+{
+	physaddr_t *entry;
+	uintptr_t next, next_end;
+	int res;
+
+	for (next = base; ; next = next_end + 1) {
+#ifdef WALK_PRESENT_ONLY
+		res = walk_skip_holes(ptbl, &next, end, PAGE_TABLE_SHIFT,
+			walker, WALK_HOLE_FN);
+
+		if (res <= 0)
+			return res;
+#endif
+
+		next_end = MIN(ptbl_end(next), end);
+		entry = ptbl->entries + PAGE_TABLE_INDEX(next);
+
+#ifdef WALK_PTE
+		res = WALK_FN(sync)(walker);
+
+		if (res < 0)
+			return res;
+
+		res = WALK_PTE(entry, next, next_end, walker);
+
+		if (res < 0)
+			return res;
+#endif
+
+#if defined(WALK_HOLE) && !defined(WALK_PRESENT_ONLY)
+		if (!(*entry & PAGE_PRESENT)) {
+			res = WALK_HOLE(next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+#endif
+
+		if (next_end == end)
+			break;
+	}
+
+	return 0;
+}
+#endif
+
+#ifdef WALK_PDIR
+static __always_inline int WALK_FN(pdir)(struct page_table *pdir,
+    uintptr_t base, uintptr_t end, struct page_walker *walker)
+{
+	physaddr_t *entry;
+	uintptr_t next, next_end;
+	int res;
+
+	for (next = base; ; next = next_end + 1) {
+#ifdef WALK_PRESENT_ONLY
+		res = walk_skip_holes(pdir, &next, end, PAGE_DIR_SHIFT,
+			walker, WALK_HOLE_FN);
+
+		if (res <= 0)
+			return res;
+#endif
+
+		next_end = MIN(pdir_end(next), end);
+		entry = pdir->entries + PAGE_DIR_INDEX(next);
+
+#ifdef WALK_PDE
+		res = WALK_FN(sync)(walker);
+
+		if (res < 0)
+			return res;
+
+		res = WALK_PDE(entry, next, next_end, walker);
+
+		if (res < 0)
+			return res;
+#endif
+
+#if defined(WALK_HOLE) && !defined(WALK_PRESENT_ONLY)
+		if (!(*entry & PAGE_PRESENT)) {
+			res = WALK_HOLE(next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+#endif
+
+#ifdef WALK_PTBL
+		if ((*entry & PAGE_PRESENT) && !(*entry & PAGE_HUGE)) {
+			res = WALK_FN(ptbl)(KADDR(PAGE_ADDR(*entry)), next,
+				next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+#endif
+
+#ifdef WALK_PDE_UNMAP
+		if (*entry & PAGE_PRESENT) {
+			res = WALK_FN(sync)(walker);
+
+			if (res < 0)
+				return res;
+
+			res = WALK_PDE_UNMAP(entry, next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+#endif
+
+		if (next_end == end)
+			break;
+	}
+
+	return 0;
+}
+#endif
+
+#ifdef WALK_PDPT
+static __always_inline int WALK_FN(pdpt)(struct page_table *pdpt,
+    uintptr_t base, uintptr_t end, struct page_walker *walker)
+{
+	physaddr_t *entry;
+	uintptr_t next, next_end;
+	int res;
+
+	for (next = base; ; next = next_end + 1) {
+#ifdef WALK_PRESENT_ONLY
+		res = walk_skip_holes(pdpt, &next, end, PDPT_SHIFT,
+			walker, WALK_HOLE_FN);
+
+		if (res <= 0)
+			return res;
+#endif
+
+		next_end = MIN(pdpt_end(next), end);
+		entry = pdpt->entries + PDPT_INDEX(next);
+
+#ifdef WALK_PDPTE
+		res = WALK_FN(sync)(walker);
+
+		if (res < 0)
+			return res;
+
+		res = WALK_PDPTE(entry, next, next_end, walker);
+
+		if (res < 0)
+			return res;
+#endif
+
+#if defined(WALK_HOLE) && !defined(WALK_PRESENT_ONLY)
+		if (!(*entry & PAGE_PRESENT)) {
+			res = WALK_HOLE(next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+#endif
+
+#ifdef WALK_PDIR
+		if ((*entry & PAGE_PRESENT) && !(*entry & PAGE_HUGE)) {
+			res = WALK_FN(pdir)(KADDR(PAGE_ADDR(*entry)), next,
+				next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+#endif
+
+#ifdef WALK_PDPTE_UNMAP
+		if (*entry & PAGE_PRESENT) {
+			res = WALK_FN(sync)(walker);
+
+			if (res < 0)
+				return res;
+
+			res = WALK_PDPTE_UNMAP(entry, next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+#endif
+
+		if (next_end == end)
+			break;
+	}
+
+	return 0;
+}
+#endif
+
+static int WALK_NAME(struct page_table *pml4, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	physaddr_t *entry;
+	uintptr_t next, next_end;
+	int res;
+
+#ifdef WALK_PRESENT_ONLY
+	walker->hole_pending = false;
+#endif
+
+	for (next = base; next <= end; next = sign_extend(next_end + 1)) {
+#ifdef WALK_PRESENT_ONLY
+		res = walk_skip_holes(pml4, &next, end, PML4_SHIFT,
+			walker, WALK_HOLE_FN);
+
+		if (res < 0)
+			return res;
+
+		if (res == 0)
+			break;
+#endif
+
+		next_end = MIN(pml4_end(next), end);
+		entry = pml4->entries + PML4_INDEX(next);
+
+#ifdef WALK_PML4E
+		res = WALK_FN(sync)(walker);
+
+		if (res < 0)
+			return res;
+
+		res = WALK_PML4E(entry, next, next_end, walker);
+
+		if (res < 0)
+			return res;
+#endif
+
+#if defined(WALK_HOLE) && !defined(WALK_PRESENT_ONLY)
+		if (!(*entry & PAGE_PRESENT)) {
+			res = WALK_HOLE(next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+#endif
+
+#ifdef WALK_PDPT
+		if (*entry & PAGE_PRESENT) {
+			res = WALK_FN(pdpt)(KADDR(PAGE_ADDR(*entry)), next,
+				next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+#endif
+
+#ifdef WALK_PML4E_UNMAP
+		if (*entry & PAGE_PRESENT) {
+			res = WALK_FN(sync)(walker);
+
+			if (res < 0)
+				return res;
+
+			res = WALK_PML4E_UNMAP(entry, next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+#endif
+
+		if (next_end == end)
+			break;
+	}
+
+	return WALK_FN(sync)(walker);
+}
+
+#undef WALK_NAME
+#undef WALK_PTE
+#undef WALK_PDE
+#undef WALK_PDPTE
+#undef WALK_PML4E
+#undef WALK_HOLE
+#undef WALK_PDE_UNMAP
+#undef WALK_PDPTE_UNMAP
+#undef WALK_PML4E_UNMAP
+#undef WALK_PRESENT_ONLY
+#undef WALK_HOLE_FN
+#undef WALK_PTBL
+#undef WALK_PDIR
+#undef WALK_PDPT
+#undef WALK_FN
+#undef WALK_CAT
+#undef WALK_CAT_
@@ -18,6 +18,12 @@ int mon_help(int argc, char **argv, struct int_frame *frame);
 int mon_kerninfo(int argc, char **argv, struct int_frame *frame);
 int mon_backtrace(int argc, char **argv, struct int_frame *frame);
 int mon_buddyinfo(int argc, char **argv, struct int_frame *frame);
+int mon_compact(int argc, char **argv, struct int_frame *frame);
+int mon_kmeminfo(int argc, char **argv, struct int_frame *frame);
+int mon_lookupbench(int argc, char **argv, struct int_frame *frame);
 int mon_pageinfo(int argc, char **argv, struct int_frame *frame);
 int mon_ptdump(int argc, char **argv, struct int_frame *frame);
+int mon_thp(int argc, char **argv, struct int_frame *frame);
+int mon_tlbbench(int argc, char **argv, struct int_frame *frame);
+int mon_walkbench(int argc, char **argv, struct int_frame *frame);
 
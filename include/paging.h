@@ -17,8 +17,11 @@
  * FIXME: where?
  */
 struct page_info {
-	/* Next page on the free list. */
-	struct list pp_node;
+	/* Indices into the pages array of the next and previous page on the
+	 * same page list, or PAGE_LIST_NIL at either end of the list. A page
+	 * that is not on any list links to itself.
+	 */
+	uint32_t pp_next, pp_prev;
 
 	/* pp_ref is the count of pointers (usually in page table entries)
 	 * to this page, for pages allocated using page_alloc.
@@ -32,8 +35,36 @@ struct page_info {
 	/* Whether the page is actually free. */
 	uint8_t pp_free : 1;
 
-	/* Reserved. */
-	uint64_t pp_zero;
+	/* Page flags (PP_*). */
+	uint8_t pp_flags;
+
+	/* Private to the owner of the page. */
+	union {
+		uint32_t pp_private;
+
+		/* Pages of the slab allocator (PP_SLAB). */
+		struct {
+			/* The index of the struct kmem_cache. */
+			uint32_t pp_slab_cache : 8;
+			/* The number of allocated objects. */
+			uint32_t pp_slab_inuse : 12;
+			/* The index of the first free object. */
+			uint32_t pp_slab_free : 12;
+		};
+	};
+};
+
+/* Four struct page_info structs share a cache line. */
+_Static_assert(sizeof(struct page_info) == 16, "struct page_info is 16 bytes");
+
+#define PAGE_LIST_NIL ((uint32_t)-1)
+
+/* A list of pages linked through pp_next and pp_prev. */
+struct page_list {
+	uint32_t first, last;
 };
+
+#define PAGE_LIST_INIT { PAGE_LIST_NIL, PAGE_LIST_NIL }
+
 #endif /* !__ASSEMBLER__ */
 
@@ -18,6 +18,9 @@ void *memcpy(void *dst, const void *src, size_t len);
 void *memmove(void *dst, const void *src, size_t len);
 int memcmp(const void *s1, const void *s2, size_t len);
 void *memfind(const void *s, int c, size_t len);
+void *memset_nt(void *dst, int c, size_t len);
+void *memcpy_nt(void *dst, const void *src, size_t len);
+void string_init(void);
 
 long strtol(const char *s, char **endptr, int base);
 
@@ -3,9 +3,14 @@
 #define CR0_PM     (1 << 0)
 #define CR0_PAGING (1 << 31)
 
-#define CR4_PAE  (1 << 5)
-#define CR4_SMEP (1 << 20)
-#define CR4_SMAP (1 << 21)
+#define CR3_PCID_MASK 0xFFF
+#define CR3_NOFLUSH   (1ULL << 63)
+
+#define CR4_PAE   (1 << 5)
+#define CR4_PGE   (1 << 7)
+#define CR4_PCIDE (1 << 17)
+#define CR4_SMEP  (1 << 20)
+#define CR4_SMAP  (1 << 21)
 
 #define FLAGS_CF      (1 << 0)
 #define FLAGS_PF      (1 << 2)
@@ -252,9 +257,11 @@ static inline void outsl(uint16_t port, const void *addr, size_t n)
 
 static inline uint64_t read_tsc(void)
 {
-	uint64_t ret;
-	asm volatile("rdtsc" : "=A" (ret));
-	return ret;
+	uint32_t lo, hi;
+
+	/* On x86-64 the "A" constraint does not refer to the edx:eax pair. */
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
 }
 
 static inline uint32_t xchg(volatile uint32_t *addr, uint32_t newval)
@@ -270,14 +277,14 @@ static inline uint32_t xchg(volatile uint32_t *addr, uint32_t newval)
 	return ret;
 }
 
-static inline void cpuid(unsigned long fn, uint32_t *eaxp, uint32_t *ebxp,
-	uint32_t *ecxp, uint32_t *edxp)
+static inline void cpuid_count(unsigned long fn, unsigned long subfn,
+	uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp)
 {
 	uint32_t eax, ebx, ecx, edx;
 
 	asm volatile("cpuid" :
 		"=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) :
-		"a" (fn));
+		"a" (fn), "c" (subfn));
 
 	if (eaxp)
 		*eaxp = eax;
@@ -292,5 +299,11 @@ static inline void cpuid(unsigned long fn, uint32_t *eaxp, uint32_t *ebxp,
 		*edxp = edx;
 }
 
+static inline void cpuid(unsigned long fn, uint32_t *eaxp, uint32_t *ebxp,
+	uint32_t *ecxp, uint32_t *edxp)
+{
+	cpuid_count(fn, 0, eaxp, ebxp, ecxp, edxp);
+}
+
 #endif /* !defined(__ASSEMBLER__) */
 
@@ -35,6 +35,9 @@
 #define PDPT_SPAN       (UINT64_C(1) << PML4_SHIFT)
 #endif
 
+/* The size of a page mapped by a PDPTE with PAGE_HUGE set. */
+#define GPAGE_SIZE PAGE_DIR_SPAN
+
 #define PAGE_TABLE_MASK ((1 << 9) - 1)
 #define PAGE_DIR_MASK   ((1 << 9) - 1)
 #define PDPT_MASK       ((1 << 9) - 1)
@@ -85,5 +88,10 @@ static inline int hpage_aligned(uintptr_t p)
 {
 	return !(p & (HPAGE_SIZE - 1));
 }
+
+static inline int gpage_aligned(uintptr_t p)
+{
+	return !(p & (GPAGE_SIZE - 1));
+}
 #endif /* !defined(__ASSEMBLER__) */
 
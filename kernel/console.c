@@ -4,6 +4,7 @@
 #include <assert.h>
 
 #include <kernel/console.h>
+#include <kernel/mem/idle.h>
 #include <kernel/pic.h>
 
 static void cons_intr(int (*proc)(void));
@@ -443,8 +444,9 @@ int getchar(void)
 {
     int c;
 
+    /* Use the time spent waiting for input to do background work. */
     while ((c = cons_getc()) == 0)
-        /* do nothing */;
+        mem_idle();
     return c;
 }
 
@@ -16,6 +16,9 @@ void kmain(struct boot_info *boot_info)
 	 */
 	memset(edata, 0, end - edata);
 
+	/* Pick the fastest string routines that the CPU supports. */
+	string_init();
+
 	/* Initialize the console.
 	 * Can't call cprintf until after we do this! */
 	cons_init();
@@ -1,39 +1,250 @@
 #include <types.h>
-#include <list.h>
 #include <paging.h>
 #include <string.h>
 
+#include <x86-64/asm.h>
+
 #include <kernel/mem.h>
 
-#define FIND_BUDDY(p) pa2page(page2pa(p) ^ ((1 << (lhs->pp_order)) * PAGE_SIZE))
+#define FIND_BUDDY(p) pa2page(page2pa(p) ^ ((1 << (p->pp_order)) * PAGE_SIZE))
 #define FIND_PRIMARY(p) pa2page(page2pa(p) & (((long)-1 << (1 + p->pp_order)) * PAGE_SIZE))
 
+/* Returns the base 2 logarithm of n rounded down. */
+static inline size_t ilog2(size_t n)
+{
+	return 63 - __builtin_clzl(n);
+}
+
 /* Physical page metadata. */
 size_t npages;
 struct page_info *pages;
 
 /*
  * List of free buddy chunks (often also referred to as buddy pages or simply
- * pages). Each order has a list containing all free buddy chunks of the
- * specific buddy order. Buddy orders go from 0 to BUDDY_MAX_ORDER - 1
+ * pages). Each mobility type has a list for every order containing all free
+ * buddy chunks of the specific buddy order that lie in pageblocks of that
+ * type. Buddy orders go from 0 to BUDDY_MAX_ORDER - 1
+ */
+struct page_list buddy_free_list[MIGRATE_TYPES][BUDDY_MAX_ORDER];
+
+/*
+ * The number of free buddy chunks on each of the free lists, and a bitmask
+ * that has bit k set if and only if the free list of order k is not empty.
+ * These are kept up to date by buddy_list_add() and buddy_list_del(), such
+ * that neither the statistics nor buddy_find() have to walk the free lists.
+ */
+size_t buddy_free_count[BUDDY_MAX_ORDER];
+uint32_t buddy_free_mask;
+
+/* The same, but for the free lists of every mobility type. */
+size_t buddy_type_count[MIGRATE_TYPES][BUDDY_MAX_ORDER];
+uint32_t buddy_type_mask[MIGRATE_TYPES];
+
+/* The number of times a chunk was taken from a pageblock of another type. */
+size_t buddy_nsteals;
+
+/*
+ * The mobility types to take free chunks from when the free lists of a type
+ * run empty, in the order of preference.
+ */
+static const int buddy_fallbacks[MIGRATE_TYPES][MIGRATE_TYPES - 1] = {
+	[MIGRATE_MOVABLE]     = { MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE },
+	[MIGRATE_UNMOVABLE]   = { MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE },
+	[MIGRATE_RECLAIMABLE] = { MIGRATE_UNMOVABLE, MIGRATE_MOVABLE },
+};
+
+static const char *migrate_names[MIGRATE_TYPES] = {
+	[MIGRATE_MOVABLE]     = "movable",
+	[MIGRATE_UNMOVABLE]   = "unmovable",
+	[MIGRATE_RECLAIMABLE] = "reclaimable",
+};
+
+/*
+ * Free chunks that are known to be cleared are marked with PP_ZERO and kept at
+ * the end of the free lists, while other free chunks are added to the front.
+ * buddy_zero_count[] and buddy_zero_mask keep track of the cleared chunks in
+ * the same way as buddy_free_count[] and buddy_free_mask.
+ */
+size_t buddy_zero_count[BUDDY_MAX_ORDER];
+uint32_t buddy_zero_mask;
+
+/*
+ * The free chunk that buddy_zero_idle() is clearing, and the number of pages
+ * of the chunk that have been cleared so far. buddy_list_del() drops the chunk
+ * as soon as it leaves its free list, as it may be written to from then on.
+ */
+static struct page_info *buddy_zero_chunk;
+static size_t buddy_zero_done;
+
+/* The number of ALLOC_ZERO allocations served with pre-zeroed pages. */
+size_t buddy_zero_hits, buddy_zero_misses;
+
+/*
+ * The number of struct page_info structs of which the initialization is still
+ * pending, and the number of struct page_info structs of which the
+ * initialization got deferred while setting up the buddy allocator.
+ */
+size_t buddy_ndeferred;
+size_t buddy_ndeferred_boot;
+
+/* The page index at which buddy_init_idle() continues. */
+static size_t buddy_init_cursor;
+
+/* The number of cycles spent in buddy_map_chunk() and the number of sections
+ * it mapped.
+ */
+uint64_t buddy_map_cycles;
+size_t buddy_map_nchunks;
+
+/*
+ * Order 0 pages are allocated from and freed to a per-CPU cache of hot pages
+ * first, such that most allocations and frees of single pages do not have to
+ * split or merge chunks. The cache is a LIFO list, as the most recently freed
+ * page is the one most likely to still be in the CPU cache. Once the cache
+ * runs empty, it gets refilled with PAGE_CACHE_BATCH pages from the buddy
+ * allocator. Once the cache grows beyond PAGE_CACHE_HIGH pages, the coldest
+ * PAGE_CACHE_BATCH pages are returned to the buddy allocator.
+ *
+ * Pages in the cache are not free as far as the buddy allocator is concerned,
+ * i.e. pp_free is not set, but they are on the list of the cache.
+ */
+#define PAGE_CACHE_BATCH 16
+#define PAGE_CACHE_HIGH  64
+
+struct page_cache {
+	struct page_list pages[MIGRATE_TYPES];
+	size_t count;
+	size_t nhits, nmisses;
+};
+
+/* Only the boot CPU is running, so there is a single cache for now. */
+static struct page_cache cpu_page_cache = {
+	.pages = { PAGE_LIST_INIT, PAGE_LIST_INIT, PAGE_LIST_INIT },
+};
+static bool page_cache_enabled = true;
+
+static struct page_cache *this_page_cache(void)
+{
+	return &cpu_page_cache;
+}
+
+/* Returns the first page of the pageblock that contains the page. */
+static struct page_info *pageblock_head(struct page_info *page)
+{
+	return pages + ROUNDDOWN((size_t)(page - pages), PAGEBLOCK_PAGES);
+}
+
+/* Returns the mobility type of the pageblock that contains the page. */
+static int pageblock_type(struct page_info *page)
+{
+	return (pageblock_head(page)->pp_flags & PP_MIGRATE_MASK) >>
+		PP_MIGRATE_SHIFT;
+}
+
+/* Sets the mobility type of the pageblocks covered by the chunk of the given
+ * order. The chunk may not be on a free list.
+ */
+static void set_pageblock_type(struct page_info *page, size_t order, int type)
+{
+	struct page_info *head;
+	size_t i, nblocks = 1;
+
+	if (order > PAGEBLOCK_ORDER)
+		nblocks <<= order - PAGEBLOCK_ORDER;
+
+	for (i = 0; i < nblocks; ++i) {
+		head = pageblock_head(page + i * PAGEBLOCK_PAGES);
+		head->pp_flags = (head->pp_flags & ~PP_MIGRATE_MASK) |
+			(type << PP_MIGRATE_SHIFT);
+	}
+}
+
+/* Adds the free chunk to the free list that matches its order and the type of
+ * its pageblock.
  */
-struct list buddy_free_list[BUDDY_MAX_ORDER];
+static void buddy_list_add(struct page_info *page)
+{
+	int type = pageblock_type(page);
+	struct page_list *list = &buddy_free_list[type][page->pp_order];
+
+	if (page->pp_flags & PP_ZERO) {
+		page_list_add_tail(list, page);
+		++buddy_zero_count[page->pp_order];
+		buddy_zero_mask |= 1 << page->pp_order;
+	} else {
+		page_list_add(list, page);
+	}
+
+	++buddy_free_count[page->pp_order];
+	buddy_free_mask |= 1 << page->pp_order;
+	++buddy_type_count[type][page->pp_order];
+	buddy_type_mask[type] |= 1 << page->pp_order;
+}
+
+/* Removes the free chunk from the free list that matches its order. */
+static void buddy_list_del(struct page_info *page)
+{
+	int type = pageblock_type(page);
+
+	page_list_del(&buddy_free_list[type][page->pp_order], page);
+
+	if (page == buddy_zero_chunk)
+		buddy_zero_chunk = NULL;
+
+	if (--buddy_free_count[page->pp_order] == 0)
+		buddy_free_mask &= ~(1 << page->pp_order);
+
+	if (--buddy_type_count[type][page->pp_order] == 0)
+		buddy_type_mask[type] &= ~(1 << page->pp_order);
+
+	if ((page->pp_flags & PP_ZERO) &&
+	    --buddy_zero_count[page->pp_order] == 0)
+		buddy_zero_mask &= ~(1 << page->pp_order);
+}
 
 // Counts the number of free pages for the given order.
 size_t count_free_pages(size_t order)
 {
-	struct list *node;
-	size_t nfree_pages = 0;
-
 	if (order >= BUDDY_MAX_ORDER) {
 		return 0;
 	}
 
-	list_foreach(buddy_free_list + order, node) {
-		++nfree_pages;
+	return buddy_free_count[order];
+}
+
+/*
+ * Shows the number of pageblocks and the amount of free memory of every
+ * mobility type, as well as the fragmentation index of the type: the share of
+ * its free memory that is in chunks too small to serve a 2M allocation.
+ */
+static void show_buddy_types(void)
+{
+	size_t nblocks[MIGRATE_TYPES] = { 0 };
+	size_t i, order, nfree, nsmall;
+	int type;
+
+	for (i = 0; i < npages; i += PAGEBLOCK_PAGES)
+		++nblocks[pageblock_type(pages + i)];
+
+	for (type = 0; type < MIGRATE_TYPES; ++type) {
+		nfree = 0;
+		nsmall = 0;
+
+		for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
+			nfree += buddy_type_count[type][order] << order;
+
+			if (order < BUDDY_2M_PAGE)
+				nsmall += buddy_type_count[type][order] << order;
+		}
+
+		cprintf("  %s: %u pageblocks, %u kiB free, "
+			"fragmentation %u%%\n", migrate_names[type],
+			nblocks[type], nfree * PAGE_SIZE / 1024,
+			nfree ? nsmall * 100 / nfree : 0);
 	}
 
-	return nfree_pages;
+	cprintf("  %u chunks taken from pageblocks of another type\n",
+		buddy_nsteals);
 }
 
 /* Shows the number of free pages in the buddy allocator as well as the amount
@@ -43,11 +254,13 @@ size_t count_free_pages(size_t order)
  */
 void show_buddy_info(void)
 {
+	struct page_cache *cache;
 	struct page_info *page;
-	struct list *node;
+	size_t nlookups;
 	size_t order;
 	size_t nfree_pages;
 	size_t nfree = 0;
+	size_t nzero = 0;
 
 	cprintf("Buddy allocator:\n");
 
@@ -56,29 +269,111 @@ void show_buddy_info(void)
 
 		cprintf("  order #%u pages=%u\n", order, nfree_pages);
 
-		nfree += nfree_pages * (1 << (order + 12));
+		nfree += nfree_pages << (order + 12);
 	}
 
+	cache = this_page_cache();
+	nfree += cache->count * PAGE_SIZE;
+	nlookups = cache->nhits + cache->nmisses;
+
+	cprintf("  page cache: %u pages, %u hits, %u misses (%u%% hit rate)\n",
+		cache->count, cache->nhits, cache->nmisses,
+		nlookups ? cache->nhits * 100 / nlookups : 0);
 	cprintf("  free: %u kiB\n", nfree / 1024);
+
+	for (order = 0; order < BUDDY_MAX_ORDER; ++order)
+		nzero += buddy_zero_count[order] << (order + 12);
+
+	cprintf("  pre-zeroed: %u kiB, %u hits, %u misses\n", nzero / 1024,
+		buddy_zero_hits, buddy_zero_misses);
+	cprintf("  deferred page_info init: %u pending, %u at boot\n",
+		buddy_ndeferred, buddy_ndeferred_boot);
+
+	show_buddy_types();
 }
 
 /* Gets the total amount of free pages. */
 size_t count_total_free_pages(void)
 {
 	struct page_info *page;
-	struct list *node;
 	size_t order;
 	size_t nfree_pages;
 	size_t nfree = 0;
 
 	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
 		nfree_pages = count_free_pages(order);
-		nfree += nfree_pages * (1 << order);
+		nfree += nfree_pages << order;
 	}
 
+	/* Pages in the page cache are available for allocation as well. */
+	nfree += this_page_cache()->count;
+
 	return nfree;
 }
 
+/*
+ * Initializes the struct page_info structs of the section that contains page,
+ * if this has been deferred by buddy_map_chunk(). Only the first struct
+ * page_info of such a section is valid, as it may be the start of a free
+ * chunk of the section order or larger. The remaining structs are marked as
+ * in use and as not being on any free list.
+ */
+void buddy_init_section(struct page_info *page)
+{
+	struct page_info *head;
+	size_t i;
+
+	head = pages + ROUNDDOWN((size_t)(page - pages), BUDDY_SECTION_PAGES);
+
+	if (!(head->pp_flags & PP_UNINIT))
+		return;
+
+	for (i = 1; i < BUDDY_SECTION_PAGES; ++i) {
+		page = head + i;
+		page_node_init(page);
+
+		page->pp_ref   = 0;
+		page->pp_free  = 0;
+		page->pp_order = 0;
+		page->pp_flags = 0;
+	}
+
+	head->pp_flags &= ~PP_UNINIT;
+	buddy_ndeferred -= BUDDY_SECTION_PAGES - 1;
+}
+
+/* Initializes the sections that are covered by the chunk of the given order. */
+static void buddy_init_sections(struct page_info *page, size_t order)
+{
+	size_t i, nsections = 1;
+
+	if (order > BUDDY_SECTION_ORDER)
+		nsections <<= order - BUDDY_SECTION_ORDER;
+
+	for (i = 0; i < nsections; ++i)
+		buddy_init_section(page + i * BUDDY_SECTION_PAGES);
+}
+
+/* Initializes the next section of which the initialization has been deferred,
+ * such that the sections get initialized in the background rather than on the
+ * first allocation from them. This is meant to be called whenever the kernel
+ * is idle.
+ */
+void buddy_init_idle(void)
+{
+	struct page_info *head;
+
+	while (buddy_ndeferred && buddy_init_cursor < npages) {
+		head = pages + buddy_init_cursor;
+		buddy_init_cursor += BUDDY_SECTION_PAGES;
+
+		if (head->pp_flags & PP_UNINIT) {
+			buddy_init_section(head);
+			return;
+		}
+	}
+}
+
 /* Splits lhs into free pages until the order of the page is the requested
  * order req_order.
  *
@@ -88,19 +383,32 @@ size_t count_total_free_pages(void)
  *  - Mark the buddy page as free and add it to the free list.
  *  - Repeat until the page is of the requested order.
  *
+ * As lhs is the first page of the chunk, the buddy at order k - 1 is simply
+ * 2^(k - 1) pages further, such that every level only costs a constant amount
+ * of work, regardless of how large the chunk is.
+ *
  * Returns a page of the requested order.
  */
- struct page_info *buddy_split(struct page_info *lhs, size_t req_order)
+struct page_info *buddy_split(struct page_info *lhs, size_t req_order)
 {
-        struct page_info *buddy;
-        while(lhs->pp_order != req_order) {
-			lhs->pp_order -= 1;
-			buddy = FIND_BUDDY(lhs);
-			buddy->pp_order = lhs->pp_order;
-			buddy->pp_free = 1;
-			list_add(&buddy_free_list[buddy->pp_order], &(buddy->pp_node));
-        }
-		return lhs;
+	struct page_info *buddy;
+
+	while (lhs->pp_order != req_order) {
+		/* The buddies are about to be written, make sure the
+		 * section is initialized. */
+		if (lhs->pp_order <= BUDDY_SECTION_ORDER)
+			buddy_init_section(lhs);
+
+		lhs->pp_order -= 1;
+		buddy = lhs + ((size_t)1 << lhs->pp_order);
+		buddy->pp_order = lhs->pp_order;
+		buddy->pp_free = 1;
+		buddy->pp_flags = (buddy->pp_flags & ~PP_ZERO) |
+			(lhs->pp_flags & PP_ZERO);
+		buddy_list_add(buddy);
+	}
+
+	return lhs;
 }
 
 /* Merges the buddy of the page with the page if the buddy is free to form
@@ -122,40 +430,177 @@ size_t count_total_free_pages(void)
 struct page_info *buddy_merge(struct page_info *page)
 {
 	/*
-	 * The previous method using primary blocks has some design flaws.
-	 * The idea of this new method is:
-	 * 	1. Find the physical address of the buddy memory of page.
-	 * 	2. And then check the free list with order page -> pp_order.
-	 * 	3. If there is a node having the same physical address with the desired buddy,
-	 * 		we merge it with page.
-	 * 	4. The memory with lower address will be the primary block.
+	 * The buddy of a chunk of order k is found by flipping bit k of its page
+	 * index. Only the first page of a free chunk has pp_free set and carries
+	 * the order of the chunk, so looking at the struct page_info of the buddy
+	 * tells us in constant time whether it can be merged, without scanning
+	 * the free list.
 	 */
 	struct page_info *buddy;
-	struct list *temp;
-
-	do {
-		physaddr_t buddy_pa = page2pa(page) ^ ((1 << (page->pp_order)) * PAGE_SIZE);
-		buddy = NULL;
-
-		list_foreach(&buddy_free_list[page->pp_order], temp) {
-			struct page_info *tb = container_of(temp, struct page_info, pp_node);
-			if (page2pa(tb) == buddy_pa) {
-					buddy = tb;
-					break;
-			}
+	size_t buddy_idx;
+	uint8_t zero;
+
+	while (page->pp_order < BUDDY_MAX_ORDER - 1) {
+		buddy_idx = (page - pages) ^ ((size_t)1 << page->pp_order);
+
+		if (buddy_idx >= npages)
+			break;
+
+		buddy = pages + buddy_idx;
+
+		if (!buddy->pp_free || buddy->pp_order != page->pp_order)
+			break;
+
+		buddy_list_del(buddy);
+		page->pp_free = 0;
+		buddy->pp_free = 0;
+
+		/* The merged chunk is only cleared if both halves are. */
+		zero = page->pp_flags & buddy->pp_flags & PP_ZERO;
+		page->pp_flags &= ~PP_ZERO;
+		buddy->pp_flags &= ~PP_ZERO;
+
+		/* The chunk with the lower address becomes the primary chunk. */
+		page = (page < buddy) ? page : buddy;
+		page->pp_order += 1;
+		page->pp_free = 1;
+		page->pp_flags |= zero;
+	}
+
+	return page;
+}
+
+/*
+ * Takes the chunk out of a pageblock of another mobility type. If the chunk
+ * makes up at least half of its pageblock, the whole pageblock is claimed for
+ * the new type, such that the rest of the pageblock serves the same type too.
+ * Chunks that span more than the request and a pageblock are split first, such
+ * that only the pageblocks that are needed change type.
+ *
+ * Returns the chunk, which is of at least order req_order.
+ */
+static struct page_info *buddy_steal(struct page_info *page, size_t req_order,
+	int type)
+{
+	struct page_info *head, *chunk;
+	size_t i, order = MAX(req_order, (size_t)PAGEBLOCK_ORDER);
+
+	buddy_list_del(page);
+	page->pp_free = 0;
+	++buddy_nsteals;
+
+	if (page->pp_order > order)
+		page = buddy_split(page, order);
+
+	if (page->pp_order < PAGEBLOCK_ORDER - 1)
+		return page;
+
+	if (page->pp_order >= PAGEBLOCK_ORDER) {
+		set_pageblock_type(page, page->pp_order, type);
+		return page;
+	}
+
+	/* Move the other free chunks of the pageblock over as well. */
+	head = pageblock_head(page);
+
+	for (i = 0; i < PAGEBLOCK_PAGES; i += (size_t)1 << chunk->pp_order) {
+		chunk = head + i;
+
+		if (chunk->pp_free)
+			buddy_list_del(chunk);
+	}
+
+	set_pageblock_type(head, PAGEBLOCK_ORDER, type);
+
+	for (i = 0; i < PAGEBLOCK_PAGES; i += (size_t)1 << chunk->pp_order) {
+		chunk = head + i;
+
+		if (chunk->pp_free)
+			buddy_list_add(chunk);
+	}
+
+	return page;
+}
+
+/* Takes a free chunk of at least order req_order off the free lists and splits
+ * it down to req_order. Chunks are taken from the pageblocks of the given
+ * mobility type first. Once these run out, a chunk is taken from the
+ * pageblocks of another type: preferably the smallest chunk that covers both
+ * the request and a whole pageblock, or the largest chunk otherwise, such that
+ * most of the pageblocks stay intact.
+ *
+ * If zero is set, only chunks of the given type that have already been cleared
+ * are considered, and the returned page has PP_ZERO set.
+ */
+static struct page_info *buddy_take(size_t req_order, bool zero, int type)
+{
+	struct page_info *page = NULL;
+	uint32_t mask, block_mask, avail;
+	size_t order, i;
+	int fallback;
+
+	if (req_order >= BUDDY_MAX_ORDER)
+		return NULL;
+
+	mask = ~((1 << req_order) - 1);
+	block_mask = mask & ~((1 << PAGEBLOCK_ORDER) - 1);
+
+	if (zero) {
+		if (!(mask & buddy_zero_mask))
+			return NULL;
+
+		/* The cleared chunks are at the end of the free lists. */
+		for (order = req_order; !page && order < BUDDY_MAX_ORDER; ++order) {
+			if (!(buddy_zero_mask & (1 << order)))
+				continue;
+
+			page = page_list_last(&buddy_free_list[type][order]);
+
+			if (page && !(page->pp_flags & PP_ZERO))
+				page = NULL;
 		}
 
-		if (buddy) {
-			list_del(&(buddy->pp_node));
-			list_del(&(page->pp_node));
-			page->pp_free = 0;
-			buddy->pp_free = 0; // the two lines are required to pass the consistency test:)
-			page = (page2pa(page) < page2pa(buddy) ? page : buddy);
-			page->pp_order += 1;
-			page->pp_free = 1; // and here again, we set the 'primary' block to free.
+		if (!page)
+			return NULL;
+
+		buddy_list_del(page);
+	} else if (mask & buddy_type_mask[type]) {
+		/* Pick the smallest non-empty order that satisfies the
+		 * request.
+		 */
+		order = __builtin_ctz(mask & buddy_type_mask[type]);
+		page = page_list_first(&buddy_free_list[type][order]);
+		buddy_list_del(page);
+	} else {
+		for (i = 0; !page && i < MIGRATE_TYPES - 1; ++i) {
+			fallback = buddy_fallbacks[type][i];
+			avail = mask & buddy_type_mask[fallback];
+
+			if (!avail)
+				continue;
+
+			if (avail & block_mask)
+				order = __builtin_ctz(avail & block_mask);
+			else
+				order = 31 - __builtin_clz(avail);
+
+			page = page_list_first(&buddy_free_list[fallback][order]);
+			page = buddy_steal(page, req_order, type);
 		}
-	} while (page->pp_order < BUDDY_MAX_ORDER && buddy != NULL);
 
+		if (!page)
+			return NULL;
+	}
+
+	if (page->pp_order > req_order) {
+		page = buddy_split(page, req_order);
+	}
+
+	/* The caller may access any page of the chunk. */
+	if (page->pp_order >= BUDDY_SECTION_ORDER)
+		buddy_init_sections(page, page->pp_order);
+
+	page->pp_free = 0;
 	return page;
 }
 
@@ -168,27 +613,229 @@ struct page_info *buddy_merge(struct page_info *page)
  */
 struct page_info *buddy_find(size_t req_order)
 {
-	size_t order = req_order;
-	while (order < BUDDY_MAX_ORDER) {
-		if (count_free_pages(order)) break;
-		order++;
+	struct page_info *page;
+
+	page = buddy_take(req_order, false, MIGRATE_UNMOVABLE);
+
+	if (page)
+		page->pp_flags &= ~PP_ZERO;
+
+	return page;
+}
+
+/* Clears the 2^order pages of the chunk starting at page. */
+static void buddy_clear(struct page_info *page, size_t order)
+{
+	char *kva = page2kva(page);
+	size_t i;
+
+	if (order >= BUDDY_2M_PAGE) {
+		for (i = 0; i < ((size_t)1 << (order - BUDDY_2M_PAGE)); ++i)
+			clear_huge_page(kva + i * HPAGE_SIZE);
+	} else {
+		for (i = 0; i < ((size_t)1 << order); ++i)
+			clear_page(kva + i * PAGE_SIZE);
 	}
-	if (order == BUDDY_MAX_ORDER)
-		return NULL;
-	struct page_info *page = container_of(list_pop_tail(buddy_free_list + order), struct page_info, pp_node);
-	if (order > req_order) {
-		page = buddy_split(page, req_order);
+}
+
+/* Picks the free chunk of the largest order that is not known to be cleared
+ * yet and that is mapped at KERNEL_VMA as a whole.
+ *
+ * Returns the chunk or NULL if there is no such chunk.
+ */
+static struct page_info *buddy_zero_pick(void)
+{
+	struct page_info *page;
+	size_t order;
+	int type;
+
+	for (order = BUDDY_MAX_ORDER; order-- > 0;) {
+		if (buddy_free_count[order] == buddy_zero_count[order])
+			continue;
+
+		/* The chunks that still need to be cleared are at the front. */
+		for (type = 0; type < MIGRATE_TYPES; ++type) {
+			page = page_list_first(&buddy_free_list[type][order]);
+
+			if (!page || (page->pp_flags & PP_ZERO))
+				continue;
+
+			if (page2pa(page) + ((physaddr_t)PAGE_SIZE << order) <=
+			    boot_map_lim)
+				return page;
+		}
 	}
-	page->pp_free = 0;
+
+	return NULL;
+}
+
+/*
+ * Clears a free chunk that is not known to be cleared yet, starting with the
+ * largest orders, and once it has been cleared as a whole, moves it to the end
+ * of its free list, such that page_alloc() can serve ALLOC_ZERO requests
+ * without having to clear the page. To bound the amount of work, every call
+ * clears at most a 2M piece of the chunk and picks up where the previous call
+ * left off. This is meant to be called whenever the kernel is idle.
+ *
+ * Returns the number of pages that got cleared.
+ */
+size_t buddy_zero_idle(void)
+{
+	struct page_info *page;
+	size_t order;
+
+	if (!buddy_zero_chunk) {
+		buddy_zero_chunk = buddy_zero_pick();
+		buddy_zero_done = 0;
+	}
+
+	page = buddy_zero_chunk;
+
+	if (!page)
+		return 0;
+
+	order = MIN((size_t)page->pp_order, (size_t)BUDDY_2M_PAGE);
+	buddy_clear(page + buddy_zero_done, order);
+	buddy_zero_done += (size_t)1 << order;
+
+	if (buddy_zero_done == ((size_t)1 << page->pp_order)) {
+		buddy_list_del(page);
+		page->pp_flags |= PP_ZERO;
+		buddy_list_add(page);
+	}
+
+	return (size_t)1 << order;
+}
+
+/* Marks the page as free and returns it to the free lists. */
+static void buddy_free_page(struct page_info *pp)
+{
+	pp->pp_free = 1;
+	pp->pp_flags &= ~PP_ZERO;
+	buddy_list_add(buddy_merge(pp));
+}
+
+/* Moves up to PAGE_CACHE_BATCH pages of the given mobility type from the buddy
+ * allocator to the cache.
+ */
+static void page_cache_refill(struct page_cache *cache, int type)
+{
+	struct page_info *page;
+	size_t i;
+
+	for (i = 0; i < PAGE_CACHE_BATCH; ++i) {
+		page = buddy_take(BUDDY_4K_PAGE, false, type);
+
+		if (!page)
+			break;
+
+		page->pp_flags &= ~PP_ZERO;
+		page_list_add_tail(&cache->pages[type], page);
+		++cache->count;
+	}
+}
+
+/* Returns up to n of the coldest pages of the given mobility type in the cache
+ * to the buddy allocator.
+ */
+static void page_cache_shrink(struct page_cache *cache, int type, size_t n)
+{
+	struct page_info *page;
+
+	while (n-- && (page = page_list_last(&cache->pages[type]))) {
+		page_list_del(&cache->pages[type], page);
+		--cache->count;
+		buddy_free_page(page);
+	}
+}
+
+static struct page_info *page_cache_alloc(struct page_cache *cache, int type)
+{
+	struct page_info *page;
+
+	if (page_list_is_empty(&cache->pages[type])) {
+		++cache->nmisses;
+		page_cache_refill(cache, type);
+	} else {
+		++cache->nhits;
+	}
+
+	page = page_list_first(&cache->pages[type]);
+
+	if (!page)
+		return NULL;
+
+	page_list_del(&cache->pages[type], page);
+	--cache->count;
+
 	return page;
 }
 
+/* Puts the page on the list of the cache that matches its pageblock. Pages that
+ * were taken from a pageblock of another type go back to that type.
+ */
+static void page_cache_free(struct page_cache *cache, struct page_info *pp)
+{
+	int type = pageblock_type(pp);
+
+	page_list_add(&cache->pages[type], pp);
+	++cache->count;
+
+	if (cache->count > PAGE_CACHE_HIGH)
+		page_cache_shrink(cache, type, PAGE_CACHE_BATCH);
+}
+
+/* Returns all the pages in the page cache to the buddy allocator. */
+void page_cache_drain(void)
+{
+	struct page_cache *cache = this_page_cache();
+	int type;
+
+	for (type = 0; type < MIGRATE_TYPES; ++type)
+		page_cache_shrink(cache, type, cache->count);
+}
+
+/*
+ * Enables or disables the page cache. Disabling the page cache drains it, such
+ * that all free pages are on the free lists of the buddy allocator.
+ *
+ * Returns whether the page cache was enabled before.
+ */
+bool page_cache_enable(bool enable)
+{
+	bool was_enabled = page_cache_enabled;
+
+	if (!enable)
+		page_cache_drain();
+
+	page_cache_enabled = enable;
+
+	return was_enabled;
+}
+
+/* Returns the mobility type for the given allocation flags. */
+static int alloc_migrate_type(int alloc_flags)
+{
+	if (alloc_flags & ALLOC_MOVABLE)
+		return MIGRATE_MOVABLE;
+
+	if (alloc_flags & ALLOC_RECLAIMABLE)
+		return MIGRATE_RECLAIMABLE;
+
+	return MIGRATE_UNMOVABLE;
+}
+
 /*
  * Allocates a physical page.
  *
  * if (alloc_flags & ALLOC_ZERO), fills the entire returned physical page with
  * '\0' bytes.
  * if (alloc_flags & ALLOC_HUGE), returns a huge physical 2M page.
+ * if (alloc_flags & ALLOC_MOVABLE), the page can be migrated by compaction.
+ * if (alloc_flags & ALLOC_RECLAIMABLE), the page can be given back on request.
+ * if (alloc_flags & ALLOC_NOCOMPACT), a huge page allocation fails rather than
+ * compacting memory on demand.
+ * Otherwise, the page is assumed to stay in place until it gets freed.
  *
  * Beware: this function does NOT increment the reference count of the page -
  * this is the caller's responsibility.
@@ -196,37 +843,146 @@ struct page_info *buddy_find(size_t req_order)
  * Returns NULL if out of free memory.
  *
  * Hint: use buddy_find() to find a free page of the right order.
- * Hint: use page2kva() and memset() to clear the page.
+ * Hint: use page2kva() and clear_page() to clear the page.
  */
 
 struct page_info *page_alloc(int alloc_flags)
 {
-	struct page_info *page;
-	size_t nbytes;
-#ifdef BONUS_LAB1
-	if (alloc_flags & ALLOC_HUGE) {
-		page = buddy_find(9); // huge page order number
-		nbytes = 2 * 1024 * 1024;
-	} else {
-		page = buddy_find(0); // one page
-		nbytes = 4096;
-	}
-#else
-	page = buddy_find(0);
-	nbytes = 4096;
-#endif
+	if (alloc_flags & ALLOC_HUGE)
+		return page_alloc_order(BUDDY_2M_PAGE, alloc_flags);
+
+	return page_alloc_order(BUDDY_4K_PAGE, alloc_flags);
+}
+
+/*
+ * Allocates a physically contiguous chunk of 2^order pages, e.g.
+ * BUDDY_1G_PAGE for a page that can back a 1G mapping. The alloc_flags are the
+ * same as for page_alloc(), except that ALLOC_HUGE is ignored.
+ *
+ * Returns NULL if order is too large or if out of free memory.
+ */
+struct page_info *page_alloc_order(size_t order, int alloc_flags)
+{
+	struct page_info *page = NULL;
+	bool zero = alloc_flags & ALLOC_ZERO;
+	int type = alloc_migrate_type(alloc_flags);
+
+	if (order >= BUDDY_MAX_ORDER)
+		return NULL;
 #ifdef BONUS_LAB1
 	// zero the page to reduce the power of UAF
 	// we were going to implement a random alloc alg, but since
 	// the lack of random number generator support, we dropped this.
 	// (we even tried to get bios time using some asm, but there were errors)
-	memset(page2kva(page), 0, nbytes);
+	zero = true;
 #endif
-	if (alloc_flags & ALLOC_ZERO)
-		memset(page2kva(page), 0, nbytes);
+	/* Prefer a page that has already been cleared in the background. */
+	if (zero)
+		page = buddy_take(order, true, type);
+
+	if (!page && order == BUDDY_4K_PAGE && page_cache_enabled)
+		page = page_cache_alloc(this_page_cache(), type);
+	else if (!page)
+		page = buddy_take(order, false, type);
+
+	/* Try to free up a huge page by migrating pages out of the way.
+	 * Compaction only frees up regions of 2M, so it cannot help larger
+	 * orders.
+	 */
+	if (!page && order == BUDDY_2M_PAGE && compact_on_demand &&
+	    !(alloc_flags & ALLOC_NOCOMPACT) && compact_memory() == 0)
+		page = buddy_take(order, false, type);
+
+	if (!page)
+		return NULL;
+
+	if (zero && (page->pp_flags & PP_ZERO)) {
+		++buddy_zero_hits;
+	} else if (zero) {
+		++buddy_zero_misses;
+		buddy_clear(page, order);
+	}
+
+	page->pp_flags &= ~PP_ZERO;
 	return page;
 }
 
+/*
+ * Allocates n physical pages of order 0 and stores them in array.
+ *
+ * Rather than looking up every page separately, this function takes the
+ * largest chunks that are available up to the number of pages that are still
+ * needed, and hands out the pages of each chunk individually. If
+ * (alloc_flags & ALLOC_ZERO), every chunk is cleared at once.
+ *
+ * Beware: this function does NOT increment the reference count of the pages.
+ *
+ * Returns the number of pages that have been allocated, which is less than n
+ * if we run out of free memory.
+ */
+size_t page_alloc_bulk(int alloc_flags, struct page_info **array, size_t n)
+{
+	struct page_info *page;
+	size_t count = 0;
+	size_t order, i;
+
+	while (count < n) {
+		order = MIN(ilog2(n - count), (size_t)BUDDY_MAX_ORDER - 1);
+
+		while (!(page = buddy_take(order, false,
+		    alloc_migrate_type(alloc_flags))) && order > 0)
+			--order;
+
+		if (!page)
+			break;
+
+		for (i = 0; i < ((size_t)1 << order); ++i) {
+			page[i].pp_order = BUDDY_4K_PAGE;
+			page[i].pp_free = 0;
+			array[count++] = page + i;
+		}
+
+		if ((alloc_flags & ALLOC_ZERO) && !(page->pp_flags & PP_ZERO))
+			buddy_clear(page, order);
+
+		page->pp_flags &= ~PP_ZERO;
+	}
+
+	return count;
+}
+
+/*
+ * Frees the n pages of order 0 in array, of which the reference counts must
+ * have dropped to zero.
+ *
+ * Runs of physically consecutive pages are carved into the largest naturally
+ * aligned chunks, and every chunk is merged and put on the free list at once
+ * rather than page by page.
+ */
+void page_free_bulk(struct page_info **array, size_t n)
+{
+	struct page_info *page;
+	size_t i, len, order;
+
+	for (i = 0; i < n; i += len) {
+		page = array[i];
+		assert(page->pp_ref == 0);
+
+		for (len = 1; i + len < n && array[i + len] == page + len; ++len)
+			assert(page[len].pp_ref == 0);
+
+		for (; page < array[i] + len; page += (size_t)1 << order) {
+			order = MIN(ilog2(array[i] + len - page),
+				(size_t)BUDDY_MAX_ORDER - 1);
+
+			while ((page - pages) & (((size_t)1 << order) - 1))
+				--order;
+
+			buddy_free_chunk(page, order);
+		}
+	}
+}
+
 /*
  * Return a page to the free list.
  * (This function should only be called when pp->pp_ref reaches 0.)
@@ -260,91 +1016,151 @@ void page_free(struct page_info *pp)
 	if(pp->pp_free)
 		cprintf("double free detected at page %p\n", page2pa(pp));
 #endif
-	pp->pp_free = 1;
-	struct page_info *merged = buddy_merge(pp);
-	
-	list_add(&buddy_free_list[merged->pp_order], &(merged->pp_node));
+	if (page_cache_enabled && pp->pp_order == BUDDY_4K_PAGE) {
+		page_cache_free(this_page_cache(), pp);
+		return;
+	}
+
+	buddy_free_page(pp);
 }
 
 /*
- * Decrement the reference count on a page,
- * freeing it if there are no more refs.
+ * Hands a naturally aligned chunk of 2^order pages to the buddy allocator as a
+ * single free chunk. The chunk is merged with its buddies like any other chunk
+ * that gets freed, such that the resulting free lists are the same as if every
+ * page of the chunk had been freed one by one.
  */
-void page_decref(struct page_info *pp)
+void buddy_free_chunk(struct page_info *page, size_t order)
 {
-	if (--pp->pp_ref == 0) 
-		page_free(pp);
+	assert(((page - pages) & (((size_t)1 << order) - 1)) == 0);
+
+	/* Chunks smaller than a section need their section to be set up. */
+	if (order < BUDDY_SECTION_ORDER)
+		buddy_init_section(page);
+
+	page->pp_order = order;
+	buddy_free_page(page);
 }
 
-static int in_page_range(void *p)
+/*
+ * Takes the free chunk off the free lists without allocating it, such that it
+ * is neither handed out nor merged with its buddies. Pass the chunk to
+ * buddy_free_chunk() to return it to the free lists.
+ */
+void buddy_isolate(struct page_info *page)
 {
-	return ((uintptr_t)pages <= (uintptr_t)p &&
-	        (uintptr_t)p < (uintptr_t)(pages + npages));
+	assert(page->pp_free);
+
+	buddy_list_del(page);
+	page->pp_free = 0;
+	page->pp_flags &= ~PP_ZERO;
 }
 
-static void *update_ptr(void *p)
+/*
+ * Decrement the reference count on a page,
+ * freeing it if there are no more refs.
+ */
+void page_decref(struct page_info *pp)
 {
-	if (!in_page_range(p))
-		return p;
-
-	return (void *)((uintptr_t)p + KPAGES - (uintptr_t)pages);
+	if (--pp->pp_ref == 0) 
+		page_free(pp);
 }
 
+/*
+ * Switches over to the struct page_info array mapped at KPAGES. The pages are
+ * linked by their index in the array, so the free lists stay valid as they
+ * are.
+ */
 void buddy_migrate(void)
 {
-	struct page_info *page;
-	struct list *node;
-	size_t i;
-
-	for (i = 0; i < npages; ++i) {
-		page = pages + i;
-		node = &page->pp_node;
-
-		node->next = update_ptr(node->next);
-		node->prev = update_ptr(node->prev);
-	}
-
-	for (i = 0; i < BUDDY_MAX_ORDER; ++i) {
-		node = buddy_free_list + i;
-
-		node->next = update_ptr(node->next);
-		node->prev = update_ptr(node->prev);
-	}
-
 	pages = (struct page_info *)KPAGES;
 }
 
+/*
+ * Maps the struct page_info structs for the section that contains the page at
+ * the given index and extends npages to cover the section.
+ *
+ * The backing pages are not cleared and only the first struct page_info of the
+ * section gets initialized. The initialization of the other struct page_info
+ * structs is deferred until the section is first split up or allocated from,
+ * see buddy_init_section().
+ */
 int buddy_map_chunk(struct page_table *pml4, size_t index)
 {
-	struct page_info *page, *base;
-	void *end;
-	size_t nblocks = (1 << (12 + BUDDY_MAX_ORDER - 1)) / PAGE_SIZE;
-	size_t nalloc = ROUNDUP(nblocks * sizeof *page, PAGE_SIZE) / PAGE_SIZE;
-	size_t i;
+	struct page_info *backing[BUDDY_SECTION_NALLOC];
+	struct page_info *base;
+	size_t nblocks = BUDDY_SECTION_PAGES;
+	size_t nalloc = BUDDY_SECTION_NALLOC;
+	size_t i, n;
+	uint64_t start = read_tsc();
 
 	index = ROUNDDOWN(index, nblocks);
 	base = pages + index;
 
-	for (i = 0; i < nalloc; ++i) {
-		page = page_alloc(ALLOC_ZERO);
+	n = page_alloc_bulk(0, backing, nalloc);
 
-		if (!page) {
-			return -1;
-		}
+	if (n < nalloc) {
+		page_free_bulk(backing, n);
+		return -1;
+	}
 
-		if (page_insert(pml4, page, (char *)base + i * PAGE_SIZE,
+	for (i = 0; i < nalloc; ++i) {
+		if (page_insert(pml4, backing[i], (char *)base + i * PAGE_SIZE,
 		    PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC) < 0) {
+			/* Unmapping drops the last reference to the pages that
+			 * have been inserted already, which frees them.
+			 */
+			unmap_page_range(pml4, base, i * PAGE_SIZE);
+			page_free_bulk(backing + i, nalloc - i);
 			return -1;
 		}
 	}
 
-	for (i = 0; i < nblocks; ++i) {
-		page = base + i;
-		list_init(&page->pp_node);
-	}
+	page_node_init(base);
+	base->pp_ref   = 0;
+	base->pp_free  = 0;
+	base->pp_order = 0;
+	base->pp_flags = PP_UNINIT;
 
+	buddy_ndeferred += nblocks - 1;
+	buddy_ndeferred_boot += nblocks - 1;
 	npages = index + nblocks;
 
+	buddy_map_cycles += read_tsc() - start;
+	buddy_map_nchunks++;
+
 	return 0;
 }
 
+/*
+ * Measures the cycles it takes to allocate and free the backing pages of a
+ * section one page at a time and in bulk. Returns the difference, i.e. the
+ * number of cycles that buddy_map_chunk() saves per section by using
+ * page_alloc_bulk() and page_free_bulk().
+ */
+uint64_t buddy_map_bulk_savings(void)
+{
+	struct page_info *backing[BUDDY_SECTION_NALLOC];
+	uint64_t start, single, bulk;
+	size_t i, n;
+
+	start = read_tsc();
+
+	for (n = 0; n < BUDDY_SECTION_NALLOC; ++n) {
+		backing[n] = page_alloc(0);
+
+		if (!backing[n])
+			break;
+	}
+
+	for (i = 0; i < n; ++i)
+		page_free(backing[i]);
+
+	single = read_tsc() - start;
+	start = read_tsc();
+	n = page_alloc_bulk(0, backing, BUDDY_SECTION_NALLOC);
+	page_free_bulk(backing, n);
+	bulk = read_tsc() - start;
+
+	return single > bulk ? single - bulk : 0;
+}
@@ -0,0 +1,282 @@
+#include <types.h>
+#include <paging.h>
+#include <string.h>
+
+#include <kernel/mem.h>
+
+/*
+ * Memory compaction frees up a 2M region of physical memory that only has a
+ * few pages in use, by migrating those pages elsewhere and releasing the
+ * region to the buddy allocator as a single order 9 chunk.
+ *
+ * Only pages that are mapped into the user address space of the kernel PML4
+ * and referenced by nothing else can be migrated. As there is no reverse
+ * mapping, the page tables are walked to count the PTEs that map each page of
+ * the region, and a page is movable if that count matches its reference count.
+ */
+#define COMPACT_REGION_ORDER BUDDY_2M_PAGE
+#define COMPACT_REGION_PAGES (1 << COMPACT_REGION_ORDER)
+
+/* Whether page_alloc() compacts memory when a huge page allocation fails. */
+bool compact_on_demand = true;
+
+/* The maximum number of pages to migrate to free up a single region. */
+size_t compact_max_migrate = 64;
+
+static size_t compact_nsuccess, compact_nfail, compact_nmigrated;
+
+/* The number of PTEs that map each page of the region. */
+static uint16_t compact_mapcount[COMPACT_REGION_PAGES];
+
+/* The pages that the pages of the region get migrated to. */
+static struct page_info *compact_dst[COMPACT_REGION_PAGES];
+
+struct compact_info {
+	size_t base;
+	bool remap;
+	bool huge;
+};
+
+/* Returns whether the page may be migrated if nothing but PTEs refer to it. */
+static bool page_movable(struct page_info *page)
+{
+	return !page->pp_free && page->pp_ref > 0 &&
+		page->pp_order == BUDDY_4K_PAGE && !(page->pp_flags & PP_SLAB);
+}
+
+/* Counts the mappings of the pages in the region or, once the pages have been
+ * copied, points the mappings to the new pages.
+ */
+static int compact_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	struct compact_info *info = walker->udata;
+	size_t idx;
+
+	if (!(*entry & PAGE_PRESENT))
+		return 0;
+
+	idx = PAGE_INDEX(PAGE_ADDR(*entry));
+
+	if (idx < info->base || idx >= info->base + COMPACT_REGION_PAGES)
+		return 0;
+
+	idx -= info->base;
+
+	if (!info->remap) {
+		++compact_mapcount[idx];
+		return 0;
+	}
+
+	if (compact_dst[idx]) {
+		*entry = page2pa(compact_dst[idx]) | (*entry & PAGE_MASK);
+		tlb_invalidate(kernel_pml4, (void *)base);
+	}
+
+	return 0;
+}
+
+/* A huge page mapping into the region cannot be migrated. */
+static int compact_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	struct compact_info *info = walker->udata;
+	size_t idx;
+
+	if ((*entry & (PAGE_PRESENT | PAGE_HUGE)) != (PAGE_PRESENT | PAGE_HUGE))
+		return 0;
+
+	idx = PAGE_INDEX(PAGE_ADDR(*entry));
+
+	if (idx + COMPACT_REGION_PAGES > info->base &&
+	    idx < info->base + COMPACT_REGION_PAGES)
+		info->huge = true;
+
+	return 0;
+}
+
+/*
+ * Returns the number of pages that have to be migrated to free up the region
+ * starting at the page index base, or -1 if the region holds pages that cannot
+ * be migrated.
+ */
+static int compact_scan(size_t base)
+{
+	struct page_info *page;
+	size_t i;
+	int n = 0;
+
+	if (base + COMPACT_REGION_PAGES > npages)
+		return -1;
+
+	/* The section has never been allocated from. */
+	if (pages[base].pp_flags & PP_UNINIT)
+		return -1;
+
+	for (i = 0; i < COMPACT_REGION_PAGES;) {
+		page = pages + base + i;
+
+		if (page->pp_free) {
+			i += (size_t)1 << page->pp_order;
+			continue;
+		}
+
+		if (!page_movable(page))
+			return -1;
+
+		++n;
+		++i;
+	}
+
+	return n;
+}
+
+/* Puts the isolated free chunks of the region back on the free lists. */
+static void compact_undo(size_t base)
+{
+	struct page_info *page;
+	size_t i;
+
+	for (i = 0; i < COMPACT_REGION_PAGES; ++i) {
+		if (compact_dst[i]) {
+			compact_dst[i]->pp_ref = 0;
+			page_free(compact_dst[i]);
+		}
+	}
+
+	for (i = 0; i < COMPACT_REGION_PAGES;) {
+		page = pages + base + i;
+
+		if (page_movable(page)) {
+			++i;
+			continue;
+		}
+
+		i += (size_t)1 << page->pp_order;
+		buddy_free_chunk(page, page->pp_order);
+	}
+}
+
+/* Migrates the pages in use in the region starting at the page index base and
+ * releases the region as a single chunk.
+ */
+static int compact_region(size_t base)
+{
+	struct compact_info info = {
+		.base = base,
+	};
+	struct page_walker walker = {
+		.pte_callback = compact_pte,
+		.pde_callback = compact_pde,
+		.udata = &info,
+		.present_only = true,
+	};
+	struct page_info *page;
+	size_t i, nmigrated = 0;
+
+	memset(compact_mapcount, 0, sizeof compact_mapcount);
+	memset(compact_dst, 0, sizeof compact_dst);
+	walk_user_pages(kernel_pml4, &walker);
+
+	if (info.huge)
+		return -1;
+
+	for (i = 0; i < COMPACT_REGION_PAGES; ++i) {
+		page = pages + base + i;
+
+		if (page_movable(page) && page->pp_ref != compact_mapcount[i])
+			return -1;
+	}
+
+	/* Take the free chunks of the region off the free lists, such that the
+	 * new pages are allocated elsewhere.
+	 */
+	for (i = 0; i < COMPACT_REGION_PAGES;) {
+		page = pages + base + i;
+
+		if (!page->pp_free) {
+			++i;
+			continue;
+		}
+
+		i += (size_t)1 << page->pp_order;
+		buddy_isolate(page);
+	}
+
+	for (i = 0; i < COMPACT_REGION_PAGES; ++i) {
+		page = pages + base + i;
+
+		if (!page_movable(page))
+			continue;
+
+		compact_dst[i] = page_alloc(ALLOC_MOVABLE);
+
+		if (!compact_dst[i]) {
+			compact_undo(base);
+			return -1;
+		}
+
+		copy_page(page2kva(compact_dst[i]), page2kva(page));
+		compact_dst[i]->pp_ref = page->pp_ref;
+		++nmigrated;
+	}
+
+	info.remap = true;
+	walk_user_pages(kernel_pml4, &walker);
+
+	for (i = 0; i < COMPACT_REGION_PAGES; ++i) {
+		page = pages + base + i;
+		page->pp_ref = 0;
+		page->pp_order = 0;
+		page->pp_flags &= PP_MIGRATE_MASK;
+	}
+
+	buddy_free_chunk(pages + base, COMPACT_REGION_ORDER);
+	compact_nmigrated += nmigrated;
+
+	return 0;
+}
+
+/*
+ * Frees up a 2M region by migrating its pages. The region that requires the
+ * fewest pages to be migrated is picked, as long as it requires no more than
+ * compact_max_migrate pages to be migrated.
+ *
+ * Returns 0 on success and -1 if no region could be freed up.
+ */
+int compact_memory(void)
+{
+	size_t base, best = 0;
+	int n, best_n = -1;
+
+	/* The pages in the page cache are neither free nor movable. */
+	page_cache_drain();
+
+	for (base = 0; base < npages; base += COMPACT_REGION_PAGES) {
+		n = compact_scan(base);
+
+		if (n <= 0 || (size_t)n > compact_max_migrate)
+			continue;
+
+		if (best_n < 0 || n < best_n) {
+			best = base;
+			best_n = n;
+		}
+	}
+
+	if (best_n < 0 || compact_region(best) < 0) {
+		++compact_nfail;
+		return -1;
+	}
+
+	++compact_nsuccess;
+	return 0;
+}
+
+void show_compact_info(void)
+{
+	cprintf("Compaction: %s, at most %u pages per region\n",
+		compact_on_demand ? "on demand" : "manual", compact_max_migrate);
+	cprintf("  %u succeeded, %u failed, %u pages migrated\n",
+		compact_nsuccess, compact_nfail, compact_nmigrated);
+}
@@ -8,11 +8,13 @@ struct dump_info {
 	uintptr_t end;
 	uint64_t flags;
 	uint64_t mask;
+	size_t size;
 };
 
 /* Print the region before the hole if there was any and reset the info struct.
  */
-static int dump_hole(uintptr_t base, uintptr_t end, struct page_walker *walker)
+static __always_inline int dump_hole(uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
 {
 	struct dump_info *info = walker->udata;
 
@@ -28,7 +30,8 @@ static int dump_hole(uintptr_t base, uintptr_t end, struct page_walker *walker)
 
 		if (info->mask & PAGE_HUGE) {
 			cprintf(" %s",
-				(info->flags & PAGE_HUGE) ? "2M" : "4K"
+				(info->size == GPAGE_SIZE) ? "1G" :
+				(info->size == HPAGE_SIZE) ? "2M" : "4K"
 			);
 		}
 
@@ -40,18 +43,22 @@ static int dump_hole(uintptr_t base, uintptr_t end, struct page_walker *walker)
 	return 0;
 }
 
-/* Update the end pointer if the flags are the same. Otherwise print the region
- * and keep track of the new region.
+/* Update the end pointer if the flags and the page size are the same.
+ * Otherwise print the region and keep track of the new region. The page size
+ * is only taken into account if the mask contains PAGE_HUGE.
  */
-static int dump_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
-    struct page_walker *walker)
+static __always_inline int dump_entry(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker, size_t size)
 {
 	struct dump_info *info = walker->udata;
 	uint64_t flags;
 
 	flags = *entry & info->mask;
 
-	if (flags == info->flags) {
+	if (!(info->mask & PAGE_HUGE))
+		size = 0;
+
+	if (flags == info->flags && size == info->size) {
 		info->end = end;
 
 		return 0;
@@ -62,42 +69,47 @@ static int dump_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
 	info->base = base;
 	info->end = end;
 	info->flags = flags;
+	info->size = size;
 
 	return 0;
 }
 
-/* Update the end pointer if the flags are the same and the PDE points to a
- * huge page. Otherwise print the region and keep track of the new region.
- */
-static int dump_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
-    struct page_walker *walker)
+static __always_inline int dump_pte(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
 {
-	struct dump_info *info = walker->udata;
-	uint64_t flags;
+	return dump_entry(entry, base, end, walker, PAGE_SIZE);
+}
 
+/* Only PDEs and PDPTEs that point to a huge page describe a region. */
+static __always_inline int dump_pde(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
+{
 	if (!(*entry & PAGE_HUGE))
 		return 0;
 
-	flags = *entry & info->mask;
-
-	if (flags == info->flags) {
-		info->end = end;
+	return dump_entry(entry, base, end, walker, HPAGE_SIZE);
+}
 
+static __always_inline int dump_pdpte(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
+{
+	if (!(*entry & PAGE_HUGE))
 		return 0;
-	}
-
-	dump_hole(base, end, walker);
 
-	info->base = base;
-	info->end = end;
-	info->flags = flags;
-
-	return 0;
+	return dump_entry(entry, base, end, walker, GPAGE_SIZE);
 }
 
+#define WALK_NAME  dump_walk
+#define WALK_PTE   dump_pte
+#define WALK_PDE   dump_pde
+#define WALK_PDPTE dump_pdpte
+#define WALK_HOLE  dump_hole
+#define WALK_PRESENT_ONLY
+#include <kernel/mem/walk_template.h>
+
 /* Given the root pml4 to the page table hierarchy, dumps the mapped regions
  * with the same flags. mask can be PAGE_HUGE to differentiate regions mapped
- * with normal pages from those mapped with huge pages.
+ * with normal pages from those mapped with 2M or 1G pages.
  */
 int dump_page_tables(struct page_table *pml4, uint64_t mask)
 {
@@ -108,13 +120,10 @@ int dump_page_tables(struct page_table *pml4, uint64_t mask)
 		        PAGE_USER,
 	};
 	struct page_walker walker = {
-		.pte_callback = dump_pte,
-		.pde_callback = dump_pde,
-		.pt_hole_callback = dump_hole,
 		.udata = &info,
 	};
 
-	if (walk_all_pages(pml4, &walker) < 0)
+	if (dump_walk(pml4, 0, KERNEL_LIM, &walker) < 0)
 		return -1;
 
 	dump_hole(0, 0, &walker);
@@ -0,0 +1,26 @@
+#include <types.h>
+#include <paging.h>
+
+#include <kernel/mem.h>
+
+/* Performs memory management work that can be done in the background. This
+ * gets called whenever the kernel is waiting, e.g. for input in the kernel
+ * monitor, and should only do a bounded amount of work per call.
+ */
+void mem_idle(void)
+{
+	extern const char *panicstr;
+
+	/* Leave the memory state alone for inspection after a panic. */
+	if (panicstr)
+		return;
+
+	/* Initialize a section of which the initialization was deferred. */
+	buddy_init_idle();
+
+	/* Clear a free chunk ahead of time for ALLOC_ZERO allocations. */
+	buddy_zero_idle();
+
+	/* Promote fully populated page tables to huge pages. */
+	thp_idle();
+}
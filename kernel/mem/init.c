@@ -8,11 +8,45 @@
 #include <kernel/mem.h>
 #include <kernel/tests.h>
 
-extern struct list buddy_free_list[];
+extern struct page_list buddy_free_list[][BUDDY_MAX_ORDER];
+extern uint64_t buddy_map_cycles;
+extern size_t buddy_map_nchunks;
 
 /* The kernel's initial PML4. */
 struct page_table *kernel_pml4;
 
+/* Whether the CPU supports 1G pages, i.e. PDPTEs with PAGE_HUGE set. */
+bool gpage_supported;
+
+/* Whether the CPU supports tagging TLB entries with a PCID. */
+bool pcid_supported;
+
+/* Detects the paging features of the CPU. If the CPU supports PCIDs, they get
+ * enabled here, while CR3 still refers to PCID 0. Global pages get enabled as
+ * well, such that the kernel mappings survive address space switches.
+ */
+static void detect_paging_features(void)
+{
+	uint32_t max, ecx, edx;
+
+	cpuid(1, NULL, NULL, &ecx, &edx);
+	pcid_supported = ecx & (1 << 17);
+
+	if (edx & (1 << 13))
+		write_cr4(read_cr4() | CR4_PGE);
+
+	if (pcid_supported)
+		write_cr4(read_cr4() | CR4_PCIDE);
+
+	cpuid(0x80000000, &max, NULL, NULL, NULL);
+
+	if (max < 0x80000001)
+		return;
+
+	cpuid(0x80000001, NULL, NULL, NULL, &edx);
+	gpage_supported = edx & (1 << 26);
+}
+
 /* This function sets up the initial PML4 for the kernel. */
 int pml4_setup(struct boot_info *boot_info)
 {
@@ -26,6 +60,7 @@ int pml4_setup(struct boot_info *boot_info)
 	}
 
 	kernel_pml4 = page2kva(page);
+	ptbl_pages++;
 
 	/* Map in the regions used by the kernel from the ELF header passed to
 	 * us through the boot info struct.
@@ -36,6 +71,11 @@ int pml4_setup(struct boot_info *boot_info)
 	boot_map_kernel(kernel_pml4, boot_info -> elf_hdr);
 	// end
 
+	/* Map in the rest of the physical memory, such that KADDR() works for
+	 * every physical page.
+	 */
+	boot_map_physmem(kernel_pml4, boot_info);
+
 	/* Use the physical memory that 'bootstack' refers to as the kernel
 	 * stack. The kernel stack grows down from virtual address KSTACK_TOP.
 	 * Map 'bootstack' to [KSTACK_TOP - KSTACK_SIZE, KSTACK_TOP).
@@ -46,17 +86,22 @@ int pml4_setup(struct boot_info *boot_info)
 	/* LAB 2: your code here. */
 	// start
 	boot_map_region(kernel_pml4, (void *)(KSTACK_TOP - KSTACK_SIZE), KSTACK_SIZE, (physaddr_t)bootstack, PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC);
-	boot_map_region(kernel_pml4, pages, npages * PAGE_SIZE, page2pa(pages), PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC);
+	boot_map_region(kernel_pml4, (void *)KPAGES,
+		ROUNDUP(npages * sizeof *pages, PAGE_SIZE), PADDR(pages),
+		PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC);
 
 	// end
 
+	cprintf("The kernel mappings take up %u page table pages\n",
+		ptbl_pages);
+
 	/* Migrate the struct page_info structs to the newly mapped area using
 	 * buddy_migrate().
 	 */
 
 	/* LAB 2: your code here. */
 	// start
-	// TODO: didn't find buddy_migrate function
+	buddy_migrate();
 	// end
 
 	return 0;
@@ -89,9 +134,11 @@ void mem_init(struct boot_info *boot_info)
 	/* Align the areas in the memory map. */
 	align_boot_info(boot_info);
 
+	detect_paging_features();
+
 	/* Set up the buddy free lists. */
-	for (i = 0; i < BUDDY_MAX_ORDER; ++i) {
-		list_init(buddy_free_list + i);
+	for (i = 0; i < MIGRATE_TYPES * BUDDY_MAX_ORDER; ++i) {
+		page_list_init(buddy_free_list[0] + i);
 	};
 
 	/* Find the amount of pages to allocate structs for. */
@@ -143,7 +190,7 @@ void mem_init(struct boot_info *boot_info)
 
 	/* Load the kernel PML4. */
 	/* LAB 2: your code here. */
-	load_pml4((struct page_table *)PADDR(kernel_pml4));
+	tlb_switch_pml4(kernel_pml4);
 
 	/* Check the paging functions. */
 	lab2_check_paging();
@@ -153,6 +200,9 @@ void mem_init(struct boot_info *boot_info)
 
 	/* Check the buddy allocator. */
 	lab2_check_buddy(boot_info);
+
+	/* Set up the object caches for kmalloc(). */
+	kmem_init();
 }
 
 /*
@@ -167,6 +217,56 @@ bool addr_reserved(physaddr_t addr, struct boot_info *bi, uintptr_t end) {
 	(addr >= KERNEL_LMA && addr < end);
 }
 
+/* Returns whether any of the reserved pages lies within [base, limit). */
+static bool range_reserved(physaddr_t base, physaddr_t limit,
+    struct boot_info *bi, uintptr_t end)
+{
+	if (base == 0)
+		return true;
+
+	if (base <= (uintptr_t)bi->elf_hdr && (uintptr_t)bi->elf_hdr < limit)
+		return true;
+
+	if (base <= PAGE_ADDR(PADDR(bi)) && PAGE_ADDR(PADDR(bi)) < limit)
+		return true;
+
+	return base < end && KERNEL_LMA < limit;
+}
+
+/*
+ * Hands the free physical memory in [base, limit) to the buddy allocator.
+ *
+ * Rather than freeing the range page by page, the range is carved into the
+ * largest naturally aligned chunks that fit and that do not contain any
+ * reserved pages. Each chunk is then inserted at its final order with
+ * buddy_free_chunk().
+ */
+static void page_init_range(physaddr_t base, physaddr_t limit,
+    struct boot_info *bi, uintptr_t end)
+{
+	physaddr_t pa = base;
+	size_t order;
+
+	while (pa < limit) {
+		order = BUDDY_MAX_ORDER - 1;
+
+		/* Find the largest chunk that is aligned and fits the range. */
+		while (order > 0 && ((pa & ((PAGE_SIZE << order) - 1)) ||
+		       pa + (PAGE_SIZE << order) > limit))
+			--order;
+
+		/* Shrink the chunk until it no longer covers reserved pages. */
+		while (order > 0 &&
+		       range_reserved(pa, pa + (PAGE_SIZE << order), bi, end))
+			--order;
+
+		if (order > 0 || !addr_reserved(pa, bi, end))
+			buddy_free_chunk(pa2page(pa), order);
+
+		pa += PAGE_SIZE << order;
+	}
+}
+
 /*
  * Initialize page structure and memory free list. After this is done, NEVER
  * use boot_alloc() again. After this function has been called to set up the
@@ -177,21 +277,22 @@ void page_init(struct boot_info *boot_info)
 {
 	struct page_info *page;
 	struct mmap_entry *entry;
-	uintptr_t pa, end;
+	uintptr_t end;
 	size_t i;
 
 	/* Go through the array of struct page_info structs and:
-	 *  1) call list_init() to initialize the linked list node.
+	 *  1) call page_node_init() to mark the page as not on any list.
 	 *  2) set the reference count pp_ref to zero.
 	 *  3) mark the page as in use by setting pp_free to zero.
 	 *  4) set the order pp_order to zero.
 	 */
 	for (i = 0; i < npages; ++i) {
-		list_init(&pages[i].pp_node);
+		page_node_init(pages + i);
 
 		pages[i].pp_ref   = 0;
 		pages[i].pp_free  = 0;
 		pages[i].pp_order = 0;
+		pages[i].pp_flags = 0;
 	}
 
 	entry = (struct mmap_entry *)KADDR(boot_info->mmap_addr);
@@ -199,10 +300,9 @@ void page_init(struct boot_info *boot_info)
 
 	/* Go through the entries in the memory map:
 	 *  1) Ignore the entry if the region is not free memory.
-	 *  2) Iterate through the pages in the region.
-	 *  3) If the physical address is above BOOT_MAP_LIM, ignore.
-	 *  4) Hand the page to the buddy allocator by calling page_free() if
-	 *     the page is not reserved.
+	 *  2) Clip the region to BOOT_MAP_LIM.
+	 *  3) Hand the region to the buddy allocator, skipping the reserved
+	 *     pages.
 	 *
 	 * What memory is reserved?
 	 *  - Address 0 contains the IVT and BIOS data.
@@ -213,12 +313,12 @@ void page_init(struct boot_info *boot_info)
 		if (entry->type != MMAP_FREE)
 			continue;
 
-		for (pa = entry->addr; pa < entry->addr+entry->len; pa += PAGE_SIZE) {
-      // conditions check
-			if (pa >= BOOT_MAP_LIM || addr_reserved(pa, boot_info, end))
-				continue;
-			page_free(pa2page(pa));
-		}
+		if (entry->addr >= BOOT_MAP_LIM)
+			continue;
+
+		page_init_range(entry->addr,
+			MIN(entry->addr + entry->len, (uint64_t)BOOT_MAP_LIM),
+			boot_info, end);
 	}
 	show_buddy_info();
 }
@@ -230,7 +330,7 @@ void page_init_ext(struct boot_info *boot_info)
 {
 	struct page_info *page;
 	struct mmap_entry *entry;
-	uintptr_t pa, end;
+	uintptr_t end;
 	size_t i;
 
 	entry = (struct mmap_entry *)KADDR(boot_info->mmap_addr);
@@ -238,19 +338,32 @@ void page_init_ext(struct boot_info *boot_info)
 
 	/* Go through the entries in the memory map:
 	 *  1) Ignore the entry if the region is not free memory.
-	 *  2) Iterate through the pages in the region.
-	 *  3) If the physical address is below BOOT_MAP_LIM, ignore.
-	 *  4) Hand the page to the buddy allocator by calling page_free().
+	 *  2) Clip the region to start at BOOT_MAP_LIM.
+	 *  3) Map in the struct page_info structs for the region. Only the
+	 *     first struct of every section is initialized at this point.
+	 *  4) Hand the region to the buddy allocator.
 	 */
 	for (i = 0; i < boot_info->mmap_len; ++i, ++entry) {
 		if (entry->type != MMAP_FREE)
 			continue;
 
-		for (pa = entry->addr; pa < entry->addr+entry->len; pa += PAGE_SIZE) {
-			if (pa < BOOT_MAP_LIM)
-				continue;
-			page_free(pa2page(pa));
-    }
+		if (entry->addr + entry->len <= BOOT_MAP_LIM)
+			continue;
+
+		while (npages < PAGE_INDEX(entry->addr + entry->len)) {
+			if (buddy_map_chunk(kernel_pml4, npages) < 0)
+				panic("unable to map the page info structs!");
+		}
+
+		page_init_range(MAX(entry->addr, (uint64_t)BOOT_MAP_LIM),
+			entry->addr + entry->len, boot_info, end);
+	}
+
+	cprintf("Mapped the page info structs in %llu cycles\n",
+		buddy_map_cycles);
+	cprintf("Allocating the backing pages in bulk saved %llu cycles\n",
+		buddy_map_nchunks * buddy_map_bulk_savings());
+	cprintf("The page info structs take up %u kiB (%u bytes per page)\n",
+		npages * sizeof *pages / 1024, sizeof *pages);
 	show_buddy_info();
-  }
 }
@@ -4,74 +4,106 @@
 #include <kernel/mem.h>
 
 struct insert_info {
-	struct page_table *pml4;
+	struct mmu_gather *tlb;
 	struct page_info *page;
 	uint64_t flags;
 };
 
-/* If the PTE already points to a present page, the reference count of the page
- * gets decremented and the TLB gets invalidated. Then this function increments
- * the reference count of the new page and sets the PTE to the new page with
- * the user-provided permissions.
+/* If the PTE already points to a present page, the page gets gathered, such
+ * that its reference count gets decremented once the TLB has been flushed.
+ * Then this function increments the reference count of the new page and sets
+ * the PTE to the new page with the user-provided permissions.
  */
 static int insert_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
 	struct insert_info *info = walker->udata;
-	struct page_info *page;
+	physaddr_t old = *entry;
+
+	/* Take the reference first, such that re-inserting the same page does
+	 * not free it.
+	 */
+	info->page->pp_ref++;
+	*entry = page2pa(info->page) | info->flags;
 
-	/* LAB 2: your code here. */
-	// start
-	if(*entry & PAGE_PRESENT) {
-		page = pa2page(PAGE_ADDR(*entry));
-		page_decref(page);
-		tlb_invalidate(info -> pml4, page2kva(page));
+	if (old & PAGE_PRESENT) {
+		tlb_gather_range(info->tlb, base, PAGE_SIZE);
+		tlb_gather_page(info->tlb, pa2page(PAGE_ADDR(old)));
 	}
-	(info -> page -> pp_ref) += 1;
-	*entry = page2pa(info -> page) | info -> flags | PAGE_PRESENT; // I think we should set PAGE_PRESENT
-	// end
 
 	return 0;
 }
 
-/* If the PDE already points to a present huge page, the reference count of the
- * huge page gets decremented and the TLB gets invalidated. Then if the new
- * page is a 4K page, this function calls ptbl_alloc() to allocate a new page
- * table. If the new page is a 2M page, this function increments the reference
- * count of the new page and sets the PDE to the new huge page with the
- * user-provided permissions.
+/* Sets the PDE or the PDPTE to the huge page with the user-provided
+ * permissions. If a huge page was mapped at the entry, it gets gathered. If a
+ * page table was present instead, the pages mapped through it are unmapped and
+ * the page tables are freed.
  */
-static int insert_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
+static int insert_huge(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
 	struct insert_info *info = walker->udata;
-	struct page_info *page;
-	struct page_info *temp_page;
-
-	/* LAB 2: your code here. */
-	// start
-	if(*entry & PAGE_PRESENT && *entry & PAGE_HUGE) {
-		temp_page = pa2page(PAGE_ADDR(*entry));
-		page_decref(temp_page);
-		tlb_invalidate(info -> pml4, page2kva(temp_page));
-	}
-	if(*entry & PAGE_HUGE) {
-		temp_page = info -> page;
-		temp_page -> pp_ref += 1;
-		*entry = page2pa(temp_page) | info -> flags | PAGE_PRESENT;
-	} else {
-		ptbl_alloc(entry, base, end, walker);
+	physaddr_t old;
+
+	/* Only free the page tables below the entry, as the entry itself lives
+	 * in a page table that may end up empty as well.
+	 */
+	if ((*entry & PAGE_PRESENT) && !(*entry & PAGE_HUGE))
+		unmap_page_range_tlb(info->tlb, (void *)base, end - base + 1,
+			end - base + 1);
+
+	old = *entry;
+	info->page->pp_ref++;
+	*entry = page2pa(info->page) | info->flags | PAGE_HUGE;
+
+	if (old & PAGE_PRESENT) {
+		tlb_gather_range(info->tlb, base, end - base + 1);
+		tlb_gather_page(info->tlb, pa2page(PAGE_ADDR(old)));
 	}
-	// end
 
 	return 0;
 }
 
+/* If the new page is a 4K page, this function calls ptbl_split() to split down
+ * the huge page mapped at the PDE, or to allocate a new page table. If the new
+ * page is a 2M page, this function maps the huge page using insert_huge().
+ */
+static int insert_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	struct insert_info *info = walker->udata;
+
+	if (info->page->pp_order == BUDDY_2M_PAGE)
+		return insert_huge(entry, base, end, walker);
+
+	return ptbl_split(entry, base, end, walker);
+}
+
+/* If the new page is a 1G page, this function maps the page using
+ * insert_huge(). Otherwise this function calls pdir_split() to split down the
+ * 1G page mapped at the PDPTE, or to allocate a new page directory.
+ */
+static int insert_pdpte(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	struct insert_info *info = walker->udata;
+
+	if (info->page->pp_order == BUDDY_1G_PAGE)
+		return insert_huge(entry, base, end, walker);
+
+	return pdir_split(entry, base, end, walker);
+}
 
 /* Map the physical page page at virtual address va. The flags argument
  * contains the permission to set for the PTE. The PAGE_PRESENT flag should
  * always be set.
  *
+ * The size of the mapping follows from the order of the page: pages of order
+ * BUDDY_2M_PAGE get mapped by a PDE and pages of order BUDDY_1G_PAGE by a
+ * PDPTE, provided that va is aligned to the size of the page. Any page tables
+ * that were present in the way of the huge page are freed. Pages mapped in the
+ * kernel half are marked global.
+ *
  * Requirements:
  *  - If there is already a page mapped at va, it should be removed using
  *    page_decref().
@@ -79,46 +111,58 @@ static int insert_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
  *    on demand. This can be done by providing ptbl_alloc() to the page walker.
  *  - The reference count of the page should be incremented upon a successful
  *    insertion of the page.
- *  - The TLB must be invalidated if a page was previously present at va.
- *
- * Corner-case hint: make sure to consider what happens when the same page is
- * re-inserted at the same virtual address in the same page table. However, do
- * not try to distinguish this case in your code, as this frequently leads to
- * subtle bugs. There is another elegant way to handle everything in the same
- * code path.
- *
- * Hint: what should happen when the user inserts a 2M huge page at a
- * misaligned address?
+ *  - The TLB must be invalidated if a page was previously present at va. The
+ *    replaced pages are only released after the TLB has been flushed.
  *
- * Hint: this function calls walk_page_range(), hpage_aligned()and page2pa().
+ * Returns 0 on success, or -1 if the page cannot be mapped at va.
  */
 int page_insert(struct page_table *pml4, struct page_info *page, void *va,
     uint64_t flags)
 {
-	struct insert_info info;
-	info.pml4 = pml4;
-        info.page = page;
-        info.flags = flags | PAGE_PRESENT;
+	struct mmu_gather tlb;
+	struct insert_info info = {
+		.tlb = &tlb,
+		.page = page,
+		.flags = flags | PAGE_PRESENT,
+	};
 	struct page_walker walker = {
 		.pte_callback = insert_pte,
 		.pde_callback = insert_pde,
-		/* LAB 2: your code here. */
-		// start
-		// seems like we need to add callbacks for pdpte and pml4
-		.pdpte_callback = insert_pde,
-		.pml4e_callback = insert_pte, // pml4 doesn't have huge page option
-		// end
+		.pdpte_callback = insert_pdpte,
+		.pml4e_callback = ptbl_alloc,
 		.udata = &info,
 	};
+	size_t size;
+	int ret;
 
-	/* LAB 2: your code here. */
-	// start
-	if(!hpage_aligned((uintptr_t)va)) {
-		return -1;
+	switch (page->pp_order) {
+	case BUDDY_4K_PAGE: break;
+	case BUDDY_2M_PAGE: break;
+	case BUDDY_1G_PAGE:
+		if (!gpage_supported)
+			return -1;
+		break;
+	default: return -1;
 	}
-	// end
 
-	return walk_page_range(pml4, va, (void *)((uintptr_t)va + PAGE_SIZE),
+	size = (size_t)PAGE_SIZE << page->pp_order;
+
+	if ((uintptr_t)va & (size - 1))
+		return -1;
+
+	if ((uintptr_t)va >= USER_LIM)
+		info.flags |= PAGE_GLOBAL;
+
+	tlb_gather_init(&tlb, pml4);
+	ret = walk_page_range(pml4, va, (void *)((uintptr_t)va + size),
 		&walker);
-}
 
+	/* Splitting up a huge page changes the entries that map the rest of
+	 * the enclosing 1G region.
+	 */
+	lookup_cache_invalidate(pml4, ROUNDDOWN((uintptr_t)va, GPAGE_SIZE),
+		ROUNDDOWN((uintptr_t)va, GPAGE_SIZE) + GPAGE_SIZE - 1);
+	tlb_gather_flush(&tlb);
+
+	return ret;
+}
@@ -1,8 +1,37 @@
 #include <types.h>
 #include <paging.h>
+#include <string.h>
+
+#include <x86-64/asm.h>
 
 #include <kernel/mem.h>
 
+/*
+ * A small cache of recent translations from virtual addresses to the leaf
+ * entries that map them, for each of the last few address spaces that got
+ * looked up. The cache holds pointers to the entries rather than the pages, so
+ * that changing the page an entry maps does not invalidate the cache. Anything
+ * that changes the structure of the page tables, i.e. removing a leaf entry,
+ * splitting or merging huge pages, or freeing page tables, has to invalidate
+ * the affected range with lookup_cache_invalidate().
+ */
+#define LOOKUP_CACHE_SPACES  4
+#define LOOKUP_CACHE_ENTRIES 64
+
+struct lookup_cache_entry {
+	uintptr_t va;
+	physaddr_t *entry;
+};
+
+struct lookup_cache {
+	physaddr_t root;
+	struct lookup_cache_entry entries[LOOKUP_CACHE_ENTRIES];
+};
+
+static struct lookup_cache lookup_caches[LOOKUP_CACHE_SPACES];
+static size_t lookup_cache_next;
+static size_t lookup_nhits, lookup_nmisses;
+
 struct lookup_info {
 	physaddr_t *entry;
 };
@@ -15,43 +44,64 @@ static int lookup_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
 {
 	struct lookup_info *info = walker->udata;
 
-	/* LAB 2: your code here. */
-	// start 
-	if(*entry & PAGE_PRESENT) {
-		info -> entry = entry;
-	}
-	// end
+	if (*entry & PAGE_PRESENT)
+		info->entry = entry;
+
 	return 0;
 }
 
-/* If the PDE points to a present huge page, store the pointer to the PDE into
- * the info struct of the walker. */
-static int lookup_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
+/* If the PDE or the PDPTE points to a present huge page, store the pointer to
+ * the entry into the info struct of the walker. */
+static int lookup_huge(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
 	struct lookup_info *info = walker->udata;
 
-	/* LAB 2: your code here. */
-	// start
-	if(*entry & PAGE_PRESENT) {
-                info -> entry = entry;
-        }
-	// end
+	if ((*entry & PAGE_PRESENT) && (*entry & PAGE_HUGE))
+		info->entry = entry;
+
 	return 0;
 }
 
-/* Return the page mapped at virtual address 'va'.
- * If entry_store is not zero, then we store the address of the PTE for this
- * page into entry_store.
- * This is function can be used to verify page permissions for system call
- * arguments, but should generally not be used by most callers.
- *
- * Return NULL if there is no page mapped at va.
- *
- * Hint: this function calls walk_page_range() and pa2page().
+/* Looks up the leaf entry that maps the virtual address va by indexing the
+ * page tables directly, without any callbacks. Returns NULL if no page is
+ * mapped at va.
  */
-struct page_info *page_lookup(struct page_table *pml4, void *va,
-    physaddr_t **entry_store)
+physaddr_t *lookup_entry(struct page_table *pml4, void *va)
+{
+	uintptr_t addr = (uintptr_t)va;
+	struct page_table *pt;
+	physaddr_t *entry;
+
+	/* Non-canonical addresses cannot be mapped. */
+	if ((uintptr_t)((int64_t)(addr << 16) >> 16) != addr)
+		return NULL;
+
+	entry = pml4->entries + PML4_INDEX(addr);
+
+	if (!(*entry & PAGE_PRESENT))
+		return NULL;
+
+	pt = KADDR(PAGE_ADDR(*entry));
+	entry = pt->entries + PDPT_INDEX(addr);
+
+	if (!(*entry & PAGE_PRESENT) || (*entry & PAGE_HUGE))
+		return (*entry & PAGE_PRESENT) ? entry : NULL;
+
+	pt = KADDR(PAGE_ADDR(*entry));
+	entry = pt->entries + PAGE_DIR_INDEX(addr);
+
+	if (!(*entry & PAGE_PRESENT) || (*entry & PAGE_HUGE))
+		return (*entry & PAGE_PRESENT) ? entry : NULL;
+
+	pt = KADDR(PAGE_ADDR(*entry));
+	entry = pt->entries + PAGE_TABLE_INDEX(addr);
+
+	return (*entry & PAGE_PRESENT) ? entry : NULL;
+}
+
+/* Looks up the leaf entry that maps va using the page walker. */
+static physaddr_t *lookup_walk(struct page_table *pml4, void *va)
 {
 	struct lookup_info info = {
 		.entry = NULL,
@@ -59,7 +109,8 @@ struct page_info *page_lookup(struct page_table *pml4, void *va,
 
 	struct page_walker walker = {
 		.pte_callback = lookup_pte,
-		.pde_callback = lookup_pde,
+		.pde_callback = lookup_huge,
+		.pdpte_callback = lookup_huge,
 		.udata = &info,
 	};
 
@@ -67,15 +118,143 @@ struct page_info *page_lookup(struct page_table *pml4, void *va,
 			    &walker) < 0)
 		return NULL;
 
-	/* LAB 2: your code here. */
-	// start
-	if(info.entry) {
-		if(entry_store) {
-			*entry_store = info.entry;
-		}
-		return pa2page(*(info.entry));
+	return info.entry;
+}
+
+/* Returns the cache for the address space, or NULL if there is none. */
+static struct lookup_cache *lookup_cache_find(physaddr_t root)
+{
+	size_t i;
+
+	for (i = 0; i < LOOKUP_CACHE_SPACES; ++i) {
+		if (lookup_caches[i].root == root)
+			return lookup_caches + i;
 	}
-	// end
 
 	return NULL;
 }
+
+/* Drops the cached translations of the address space for the virtual
+ * addresses in [start, end].
+ */
+void lookup_cache_invalidate(struct page_table *pml4, uintptr_t start,
+    uintptr_t end)
+{
+	struct lookup_cache *cache = lookup_cache_find(PADDR(pml4));
+	struct lookup_cache_entry *slot;
+	size_t i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < LOOKUP_CACHE_ENTRIES; ++i) {
+		slot = cache->entries + i;
+
+		if (slot->entry && slot->va >= start && slot->va <= end)
+			slot->entry = NULL;
+	}
+}
+
+/* Looks up the leaf entry that maps va through the cache, and fills the cache
+ * using lookup_entry() on a miss.
+ */
+static physaddr_t *lookup_cached(struct page_table *pml4, void *va)
+{
+	struct lookup_cache *cache;
+	struct lookup_cache_entry *slot;
+	physaddr_t root = PADDR(pml4);
+	uintptr_t addr = ROUNDDOWN((uintptr_t)va, PAGE_SIZE);
+
+	cache = lookup_cache_find(root);
+
+	if (!cache) {
+		cache = lookup_caches + lookup_cache_next;
+		lookup_cache_next = (lookup_cache_next + 1) % LOOKUP_CACHE_SPACES;
+		memset(cache, 0, sizeof *cache);
+		cache->root = root;
+	}
+
+	slot = cache->entries + PAGE_INDEX(addr) % LOOKUP_CACHE_ENTRIES;
+
+	if (slot->entry && slot->va == addr && (*slot->entry & PAGE_PRESENT)) {
+		lookup_nhits++;
+		return slot->entry;
+	}
+
+	lookup_nmisses++;
+	slot->va = addr;
+	slot->entry = lookup_entry(pml4, va);
+
+	return slot->entry;
+}
+
+/* Return the page mapped at virtual address 'va'.
+ * If entry_store is not zero, then we store the address of the PTE for this
+ * page into entry_store. For a huge page this is the PDE or the PDPTE, and the
+ * returned page is the first page of the huge page.
+ * This is function can be used to verify page permissions for system call
+ * arguments, but should generally not be used by most callers.
+ *
+ * Recent translations are cached per address space, and misses are served by
+ * lookup_entry() rather than the page walker.
+ *
+ * Return NULL if there is no page mapped at va.
+ */
+struct page_info *page_lookup(struct page_table *pml4, void *va,
+    physaddr_t **entry_store)
+{
+	physaddr_t *entry = lookup_cached(pml4, va);
+
+	if (!entry)
+		return NULL;
+
+	if (entry_store)
+		*entry_store = entry;
+
+	return pa2page(PAGE_ADDR(*entry));
+}
+
+/*
+ * Measures the cycles per lookup of the page walker, of lookup_entry() and of
+ * page_lookup() with its cache, by looking up npages consecutive pages of the
+ * kernel mapping at KERNEL_VMA for the given number of rounds.
+ */
+void lookup_benchmark(size_t npages, size_t rounds)
+{
+	uint64_t start, walk, direct, cached;
+	size_t i, j, n = npages * rounds;
+	size_t nhits = lookup_nhits, nmisses = lookup_nmisses;
+	char *base = (char *)KERNEL_VMA;
+
+	lookup_cache_invalidate(kernel_pml4, KERNEL_VMA, KERNEL_LIM);
+
+	start = read_tsc();
+
+	for (i = 0; i < rounds; ++i)
+		for (j = 0; j < npages; ++j)
+			lookup_walk(kernel_pml4, base + j * PAGE_SIZE);
+
+	walk = read_tsc() - start;
+	start = read_tsc();
+
+	for (i = 0; i < rounds; ++i)
+		for (j = 0; j < npages; ++j)
+			lookup_entry(kernel_pml4, base + j * PAGE_SIZE);
+
+	direct = read_tsc() - start;
+	start = read_tsc();
+
+	for (i = 0; i < rounds; ++i)
+		for (j = 0; j < npages; ++j)
+			page_lookup(kernel_pml4, base + j * PAGE_SIZE, NULL);
+
+	cached = read_tsc() - start;
+	nhits = lookup_nhits - nhits;
+	nmisses = lookup_nmisses - nmisses;
+
+	cprintf("lookup benchmark: %u pages, %u rounds\n", npages, rounds);
+	cprintf("  page walker:   %u cycles per lookup\n", walk / n);
+	cprintf("  lookup_entry:  %u cycles per lookup\n", direct / n);
+	cprintf("  page_lookup:   %u cycles per lookup, %u%% hits\n",
+		cached / n, nhits * 100 / (nhits + nmisses));
+}
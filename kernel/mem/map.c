@@ -3,6 +3,11 @@
 
 #include <kernel/mem.h>
 
+/* The physical memory below boot_map_lim that is free or used by the kernel is
+ * mapped at KERNEL_VMA, such that KADDR() may be dereferenced.
+ */
+physaddr_t boot_map_lim = BOOT_MAP_LIM;
+
 struct boot_map_info {
 	struct page_table *pml4;
 	uint64_t flags;
@@ -10,74 +15,199 @@ struct boot_map_info {
 	uintptr_t base, end;
 };
 
-/* Stores the physical address and the appropriate permissions into the PTE and
- * increments the physical address to point to the next page.
+/* Returns the physical address that the virtual address va maps to. */
+static __always_inline physaddr_t boot_map_pa(struct boot_map_info *info,
+    uintptr_t va)
+{
+	return info->pa + (va - info->base);
+}
+
+/* Stores the physical address and the appropriate permissions into the PTE.
  */
-static int boot_map_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
-    struct page_walker *walker)
+static __always_inline int boot_map_pte(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
 {
 	struct boot_map_info *info = walker->udata;
 
-	/* LAB 2: your code here. i*/
-	// start
-	*entry = info -> pa | info -> flags;
-	(info -> pa) += PAGE_SIZE;
-	// end
+	if (*entry & PAGE_PRESENT)
+		flush_page((void *)base);
+
+	*entry = boot_map_pa(info, base) | info->flags;
+
 	return 0;
 }
 
-/* Stores the physical address and the appropriate permissions into the PDE and
- * increments the physical address to point to the next huge page if the
- * physical address is huge page aligned and if the area to be mapped covers a
- * 2M area. Otherwise this function calls ptbl_split() to split down the huge
- * page or allocate a page table.
+/* Returns whether [base, end] can be mapped by a single page of the given
+ * size, i.e. whether the range covers the whole page and whether the physical
+ * address is aligned to the size as well.
  */
-static int boot_map_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
-    struct page_walker *walker)
+static __always_inline bool boot_map_fits(struct boot_map_info *info,
+    uintptr_t base, uintptr_t end, size_t size)
 {
-	struct boot_map_info *info = walker->udata;
+	return !(base & (size - 1)) && end - base + 1 == size &&
+	       !(boot_map_pa(info, base) & (size - 1));
+}
 
-	/* LAB 2: your code here. */
-	// start
-	*entry = info -> pa | info -> flags;
-	if(info -> flags & PAGE_HUGE) {
-		(info -> pa) += PAGE_SIZE * 512;
-	} else {
-		ptbl_split(entry, base, end, walker); // return value is ignored here.
+/* Frees the page tables below the entry that maps size bytes. As the static
+ * mappings are not reference counted, the mapped pages are left alone.
+ */
+static void boot_map_free(physaddr_t *entry, size_t size)
+{
+	struct page_table *pt = KADDR(PAGE_ADDR(*entry));
+	size_t i;
+
+	if (size > HPAGE_SIZE) {
+		for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+			if ((pt->entries[i] & PAGE_PRESENT) &&
+			    !(pt->entries[i] & PAGE_HUGE))
+				boot_map_free(pt->entries + i,
+					size / PAGE_TABLE_ENTRIES);
+		}
 	}
-	// end
+
+	page_decref(pa2page(PAGE_ADDR(*entry)));
+	*entry = 0;
+	ptbl_pages--;
+}
+
+/* Replaces the huge page at the entry that maps size bytes by a page table of
+ * which the entries map the same physical memory using pages of the next
+ * smaller size, such that part of the huge page can be remapped.
+ *
+ * Unlike ptbl_split() and pdir_split(), this function never touches any
+ * reference counts, as the static mappings are not reference counted.
+ */
+static int boot_map_split(physaddr_t *entry, uintptr_t base, size_t size)
+{
+	struct page_table *pt;
+	struct page_info *table;
+	physaddr_t pa = PAGE_ADDR(*entry), flags = *entry & PAGE_MASK;
+	size_t i, step = size / PAGE_TABLE_ENTRIES;
+
+	/* PAGE_HUGE is the PAT bit in a PTE. */
+	if (step == PAGE_SIZE)
+		flags &= ~PAGE_HUGE;
+
+	table = page_alloc(0);
+
+	if (!table)
+		return -1;
+
+	table->pp_ref++;
+	pt = page2kva(table);
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i)
+		pt->entries[i] = (pa + i * step) | flags;
+
+	*entry = page2pa(table) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+	ptbl_pages++;
+	flush_page((void *)ROUNDDOWN(base, size));
+
 	return 0;
 }
 
+/* Maps [base, end] using a single page of the given size if it fits. If it
+ * does not, the huge page at the entry is split up or a page table is
+ * allocated, such that the walker maps the range one level down.
+ */
+static __always_inline int boot_map_huge(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker, size_t size)
+{
+	struct boot_map_info *info = walker->udata;
+	physaddr_t old;
+
+	if (boot_map_fits(info, base, end, size)) {
+		old = *entry;
+		*entry = boot_map_pa(info, base) | info->flags | PAGE_HUGE;
+
+		/* The page tables of the kernel half may be cached for any
+		 * PCID, so only free them after a global flush.
+		 */
+		if ((old & PAGE_PRESENT) && !(old & PAGE_HUGE)) {
+			tlb_flush_global();
+			boot_map_free(&old, size);
+		} else if (old & PAGE_PRESENT) {
+			flush_page((void *)base);
+		}
+
+		return 0;
+	}
+
+	if ((*entry & PAGE_PRESENT) && (*entry & PAGE_HUGE))
+		return boot_map_split(entry, base, size);
+
+	return ptbl_alloc(entry, base, end, walker);
+}
+
+/* Maps the 2M area using a huge page if the area to be mapped covers it and
+ * the physical address is huge page aligned.
+ */
+static __always_inline int boot_map_pde(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
+{
+	return boot_map_huge(entry, base, end, walker, HPAGE_SIZE);
+}
+
+/* Maps the 1G area using a 1G page if the CPU supports them, the area to be
+ * mapped covers it and the physical address is aligned to 1G.
+ */
+static __always_inline int boot_map_pdpte(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
+{
+	if (!gpage_supported)
+		return ptbl_alloc(entry, base, end, walker);
+
+	return boot_map_huge(entry, base, end, walker, GPAGE_SIZE);
+}
+
+#define WALK_NAME  boot_map_walk
+#define WALK_PTE   boot_map_pte
+#define WALK_PDE   boot_map_pde
+#define WALK_PDPTE boot_map_pdpte
+#define WALK_PML4E ptbl_alloc
+#include <kernel/mem/walk_template.h>
+
 /*
  * Maps the virtual address space at [va, va + size) to the contiguous physical
  * address space at [pa, pa + size). Size is a multiple of PAGE_SIZE. The
  * permissions of the page to set are passed through the flags argument.
  *
+ * Every part of the range is mapped using the largest page that fits: 1G or
+ * 2M pages where both the virtual and the physical address are aligned and the
+ * remaining range covers the page, and 4K pages otherwise. Mapping part of an
+ * existing huge page splits it up into smaller pages that keep mapping the
+ * rest of it.
+ *
+ * Mappings in the kernel half are marked global, as every address space shares
+ * them.
+ *
  * This function is only intended to set up static mappings. As such, it should
  * not change the reference counts of the mapped pages.
- *
- * Hint: this function calls walk_page_range().
  */
 void boot_map_region(struct page_table *pml4, void *va, size_t size,
     physaddr_t pa, uint64_t flags)
 {
-	/* LAB 2: your code here. */
 	struct boot_map_info info = {
-		.pa = pa,
-		.flags = flags,
+		.pml4 = pml4,
+		.pa = ROUNDDOWN(pa, PAGE_SIZE),
+		.flags = (flags | PAGE_PRESENT) & ~PAGE_HUGE,
 		.base = ROUNDDOWN((uintptr_t)va, PAGE_SIZE),
 		.end = ROUNDUP((uintptr_t)va + size, PAGE_SIZE) - 1,
 	};
 	struct page_walker walker = {
-		.pte_callback = boot_map_pte,
-		.pde_callback = boot_map_pde,
-		/* LAB 2: your code here. */
-		// TODO: do we need add other callbacks here? --- Yiming
 		.udata = &info,
 	};
 
-	walk_page_range(pml4, va, (void *)((uintptr_t)va + size), &walker);
+	if (info.base >= USER_LIM)
+		info.flags |= PAGE_GLOBAL;
+
+	/* Splitting up huge pages changes the entries that map the rest of the
+	 * enclosing 1G regions.
+	 */
+	lookup_cache_invalidate(pml4, ROUNDDOWN(info.base, GPAGE_SIZE),
+		ROUNDDOWN(info.end, GPAGE_SIZE) + GPAGE_SIZE - 1);
+
+	boot_map_walk(pml4, info.base, info.end, &walker);
 }
 
 /* This function parses the program headers of the ELF header of the kernel
@@ -101,9 +231,9 @@ void boot_map_kernel(struct page_table *pml4, struct elf *elf_hdr)
 	struct elf_proghdr *cur_hdr;
 	uintptr_t va;
 
-	/* LAB 2: your code here. */
-	// start
-	boot_map_region(pml4, (void *)KERNEL_VMA, BOOT_MAP_LIM, 0x100000, PAGE_WRITE | PAGE_PRESENT | PAGE_NO_EXEC); // didn't find PAGE_READ
+	boot_map_region(pml4, (void *)KERNEL_VMA, BOOT_MAP_LIM, 0,
+		PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC);
+
 	for(i = 0; i < elf_hdr -> e_phnum; i++) {
 		cur_hdr = prog_hdr + i;
 		va = cur_hdr -> p_va;
@@ -118,5 +248,35 @@ void boot_map_kernel(struct page_table *pml4, struct elf *elf_hdr)
 			boot_map_region(pml4, (void *)va, cur_hdr -> p_memsz, cur_hdr -> p_pa, flags);
 		}
 	}
-	// end
+}
+
+/* Maps all of the free physical memory reported by the boot loader at
+ * KERNEL_VMA, such that KADDR() and page2kva() work for every physical page.
+ *
+ * The first BOOT_MAP_LIM bytes are left alone, as boot_map_kernel() maps them
+ * together with the kernel. Everything above is mapped RW- and, as
+ * boot_map_region() picks the page size, mostly by 1G and 2M pages.
+ */
+void boot_map_physmem(struct page_table *pml4, struct boot_info *boot_info)
+{
+	struct mmap_entry *entry;
+	physaddr_t base, end;
+	size_t i;
+
+	entry = (struct mmap_entry *)KADDR(boot_info->mmap_addr);
+
+	for (i = 0; i < boot_info->mmap_len; ++i, ++entry) {
+		if (entry->type != MMAP_FREE)
+			continue;
+
+		base = MAX(entry->addr, (physaddr_t)BOOT_MAP_LIM);
+		end = entry->addr + entry->len;
+
+		if (base >= end)
+			continue;
+
+		boot_map_region(pml4, (void *)(KERNEL_VMA + base), end - base,
+			base, PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC);
+		boot_map_lim = MAX(boot_map_lim, end);
+	}
 }
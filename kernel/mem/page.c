@@ -0,0 +1,99 @@
+#include <types.h>
+#include <string.h>
+#include <paging.h>
+
+#include <kernel/mem.h>
+
+/*
+ * Page lists link struct page_info structs through their index in the pages
+ * array rather than through pointers, which keeps struct page_info small and
+ * keeps the lists valid when the array gets remapped.
+ */
+void page_list_init(struct page_list *list)
+{
+	list->first = PAGE_LIST_NIL;
+	list->last = PAGE_LIST_NIL;
+}
+
+/* Marks the page as not being on any page list. */
+void page_node_init(struct page_info *page)
+{
+	page->pp_next = page - pages;
+	page->pp_prev = page - pages;
+}
+
+/* Adds the page to the front of the list. */
+void page_list_add(struct page_list *list, struct page_info *page)
+{
+	uint32_t idx = page - pages;
+
+	page->pp_prev = PAGE_LIST_NIL;
+	page->pp_next = list->first;
+
+	if (list->first == PAGE_LIST_NIL)
+		list->last = idx;
+	else
+		pages[list->first].pp_prev = idx;
+
+	list->first = idx;
+}
+
+/* Adds the page to the end of the list. */
+void page_list_add_tail(struct page_list *list, struct page_info *page)
+{
+	uint32_t idx = page - pages;
+
+	page->pp_next = PAGE_LIST_NIL;
+	page->pp_prev = list->last;
+
+	if (list->last == PAGE_LIST_NIL)
+		list->first = idx;
+	else
+		pages[list->last].pp_next = idx;
+
+	list->last = idx;
+}
+
+/* Removes the page from the list that it is on. */
+void page_list_del(struct page_list *list, struct page_info *page)
+{
+	if (page->pp_prev == PAGE_LIST_NIL)
+		list->first = page->pp_next;
+	else
+		pages[page->pp_prev].pp_next = page->pp_next;
+
+	if (page->pp_next == PAGE_LIST_NIL)
+		list->last = page->pp_prev;
+	else
+		pages[page->pp_next].pp_prev = page->pp_prev;
+
+	page_node_init(page);
+}
+
+/* Clears a 4K page. The page is usually about to be used by the caller, so the
+ * stores go through the caches.
+ */
+void clear_page(void *kva)
+{
+	memset(kva, 0, PAGE_SIZE);
+}
+
+/* Clears a 2M page. This does not fit in the caches anyway, so non-temporal
+ * stores are used to avoid evicting everything else.
+ */
+void clear_huge_page(void *kva)
+{
+	memset_nt(kva, 0, HPAGE_SIZE);
+}
+
+/* Copies a 4K page from src to dst. */
+void copy_page(void *dst, const void *src)
+{
+	memcpy(dst, src, PAGE_SIZE);
+}
+
+/* Copies a 2M page from src to dst using non-temporal stores. */
+void copy_huge_page(void *dst, const void *src)
+{
+	memcpy_nt(dst, src, HPAGE_SIZE);
+}
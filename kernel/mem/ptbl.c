@@ -4,6 +4,9 @@
 
 #include <kernel/mem.h>
 
+/* The number of pages in use as page tables at any level, PML4s included. */
+size_t ptbl_pages;
+
 /* Allocates a page table if none is present for the given entry.
  * If there is already something present in the PTE, then this function simply
  * returns. Otherwise, this function allocates a page using page_alloc(),
@@ -17,55 +20,189 @@ int ptbl_alloc(physaddr_t *entry, uintptr_t base, uintptr_t end,
 	// start
 	if(*entry & PAGE_PRESENT)
 		return 0;
-	struct page_info *page = page_alloc(0);
+	struct page_info *page = page_alloc(ALLOC_ZERO);
+	if (!page)
+		return -1;
 	(page -> pp_ref) += 1;
 	*entry = page2pa(page) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+	ptbl_pages++;
 	// end
 	return 0;
 }
 
-/* Splits up a huge page by allocating a new page table and setting up the huge
- * page into smaller pages that consecutively make up the huge page.
+/* Returns the page that owns the huge page of the given order at pa, or NULL if
+ * the huge page is not reference counted, e.g. because it is part of the static
+ * mappings set up by boot_map_region(). Only the head of an allocated buddy
+ * block of the same order owns the huge page: a frame that merely holds a
+ * reference as a page of its own does not.
+ */
+static struct page_info *huge_page_owner(physaddr_t pa, size_t order)
+{
+	struct page_info *page;
+
+	if (PAGE_INDEX(pa) >= npages)
+		return NULL;
+
+	page = pa2page(pa);
+
+	if (!page->pp_ref || page->pp_free || page->pp_order != order)
+		return NULL;
+
+	return page;
+}
+
+/* Splits up a huge page by allocating a new page table of which the entries
+ * map the consecutive 4K pages of the huge page.
  *
  * If no huge page was mapped at the entry, simply allocate a page table.
  *
- * Otherwise if a huge page is present, allocate a new page, increment the
- * reference count and have the PDE point to the newly allocated page. This
- * page is used as the page table. Then allocate a normal page for each entry,
- * copy over the data from the huge page and set each PDE.
- *
- * Hint: the only user of this function is boot_map_region(). Otherwise the 2M
- * physical page has to be split down into its individual 4K pages by updating
- * the respective struct page_info structs.
+ * Like pdir_split(), no data is copied, such that the virtual addresses keep
+ * mapping the same physical memory. If the 2M page is reference counted, it is
+ * split down into its individual 4K pages in place, each of which takes a
+ * reference for its PTE. This only works if the 2M page is mapped once, so
+ * shared 2M pages cannot be split.
  *
- * Hint: this function calls ptbl_alloc(), page_alloc(), page2pa() and
- * page2kva().
+ * Returns 0 on success, or -1 if the page table cannot be allocated or if the
+ * 2M page is shared, in which case the entry is left alone.
  */
 int ptbl_split(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
-	/* LAB 2: your code here. */
-	// start
-	int res;
-	if(!(*entry & PAGE_HUGE)) {
-		res = ptbl_alloc(entry, base, end, walker);
-		return res;
+	struct page_table *pt;
+	struct page_info *table, *page;
+	physaddr_t huge, flags;
+	bool refcounted;
+	size_t i;
+
+	if (!(*entry & PAGE_HUGE))
+		return ptbl_alloc(entry, base, end, walker);
+
+	huge = PAGE_ADDR(*entry);
+	flags = *entry & PAGE_MASK & ~PAGE_HUGE;
+
+	/* The other mappings of a shared page still refer to it as a whole. */
+	page = huge_page_owner(huge, BUDDY_2M_PAGE);
+	refcounted = page != NULL;
+
+	if (refcounted && page->pp_ref != 1)
+		return -1;
+
+	table = page_alloc(0);
+
+	if (!table)
+		return -1;
+
+	table->pp_ref++;
+	pt = page2kva(table);
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i)
+		pt->entries[i] = (huge + i * PAGE_SIZE) | flags;
+
+	if (refcounted) {
+		for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+			page[i].pp_order = BUDDY_4K_PAGE;
+			page[i].pp_free = 0;
+			page[i].pp_ref = 1;
+		}
+
+		thp_ndemoted++;
 	}
-	struct page_info *page = page_alloc(0);
-	(page -> pp_ref) += 1;
-	*entry = page2pa(page) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
-	physaddr_t *temp;
-	for(size_t i = 0; i < PAGE_SIZE / sizeof(physaddr_t); i++) {
-		// for each entry in the PDE (i.e., the variable entry)
-		// seems like we need to transform the pa to kva here?
-		temp = (physaddr_t *)((physaddr_t)page2kva(page) + 8);
-		res = ptbl_alloc(temp, base, end, walker);
+
+	*entry = page2pa(table) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+	ptbl_pages++;
+	flush_page((void *)ROUNDDOWN(base, PAGE_TABLE_SPAN));
+
+	return 0;
+}
+
+/* Splits up a 1G page by allocating a new page directory of which the entries
+ * map the consecutive 2M pieces of the 1G page.
+ *
+ * If no 1G page was mapped at the entry, simply allocate a page directory.
+ *
+ * No data is copied: if the 1G page is reference counted, its 2M pieces become
+ * separate order 9 pages with their own reference count, that the buddy
+ * allocator can free one by one. This only works if the 1G page is mapped
+ * once, so shared 1G pages cannot be split.
+ *
+ * Returns 0 on success, or -1 if the page directory cannot be allocated or if
+ * the 1G page is shared, in which case the entry is left alone.
+ */
+int pdir_split(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	struct page_table *pd;
+	struct page_info *table, *page;
+	physaddr_t huge, flags;
+	bool refcounted;
+	size_t i;
+
+	if (!(*entry & PAGE_HUGE))
+		return ptbl_alloc(entry, base, end, walker);
+
+	huge = PAGE_ADDR(*entry);
+	flags = *entry & PAGE_MASK;
+
+	/* The other mappings of a shared page still refer to it as a whole. */
+	page = huge_page_owner(huge, BUDDY_1G_PAGE);
+	refcounted = page != NULL;
+
+	if (refcounted && page->pp_ref != 1)
+		return -1;
+
+	table = page_alloc(0);
+
+	if (!table)
+		return -1;
+
+	table->pp_ref++;
+	pd = page2kva(table);
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i)
+		pd->entries[i] = (huge + i * HPAGE_SIZE) | flags;
+
+	if (refcounted) {
+		for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+			page[i << BUDDY_2M_PAGE].pp_order = BUDDY_2M_PAGE;
+			page[i << BUDDY_2M_PAGE].pp_free = 0;
+			page[i << BUDDY_2M_PAGE].pp_ref = 1;
+		}
 	}
-	return res;
-	// end
+
+	*entry = page2pa(table) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+	ptbl_pages++;
+	flush_page((void *)ROUNDDOWN(base, PAGE_DIR_SPAN));
+
 	return 0;
 }
 
+/* Returns the first page if the PTEs map the consecutive 4K pages of a 2M
+ * aligned physical region, each of which is mapped only once. Otherwise
+ * returns NULL.
+ */
+static struct page_info *ptbl_contiguous(struct page_table *pt)
+{
+	struct page_info *page;
+	physaddr_t pa = PAGE_ADDR(pt->entries[0]);
+	size_t i;
+
+	if (!hpage_aligned(pa) ||
+	    PAGE_INDEX(pa) + PAGE_TABLE_ENTRIES > npages)
+		return NULL;
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		if (PAGE_ADDR(pt->entries[i]) != pa + i * PAGE_SIZE)
+			return NULL;
+
+		page = pa2page(pa + i * PAGE_SIZE);
+
+		if (page->pp_ref != 1 || page->pp_order != BUDDY_4K_PAGE)
+			return NULL;
+	}
+
+	return pa2page(pa);
+}
+
 /* Attempts to merge all consecutive pages in a page table into a huge page.
  *
  * First checks if the PDE points to a huge page. If the PDE points to a huge
@@ -79,59 +216,114 @@ int ptbl_split(physaddr_t *entry, uintptr_t base, uintptr_t end,
  * Finally, it sets the PDE to point to the huge page with the flags shared
  * between the previous pages.
  *
+ * If the pages already make up a 2M aligned physical region, e.g. because
+ * they came from splitting up an order 9 chunk, no huge page is allocated.
+ * Instead, the pages are turned into a single order 9 page in place, and only
+ * the page table gets freed.
+ *
+ * The walker->udata points to a struct ptbl_merge_info that provides the PML4
+ * to flush the TLB for and the flags to allocate the huge page with.
+ * ptbl_merge() sets info->copy if the pages have to be copied, and leaves the
+ * page table alone unless info->may_copy is set.
+ *
  * Hint: don't forget to free the page table and the previously used pages.
  */
 int ptbl_merge(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
-	/* LAB 2: your code here. */
-	// start
-	int res;
-	if(*entry & PAGE_HUGE) {
-		return 0;
-	}
-	if(!(*entry & PAGE_PRESENT)) {
+	struct ptbl_merge_info *info = walker->udata;
+	struct page_table *pt;
+	struct page_info *huge;
+	physaddr_t flags;
+	uintptr_t va = ROUNDDOWN(base, PAGE_TABLE_SPAN);
+	size_t i;
+
+	if (!(*entry & PAGE_PRESENT) || (*entry & PAGE_HUGE))
 		return 0;
-	}
-	for(size_t i = 0; i < PAGE_SIZE / sizeof(physaddr_t); i++) {
-		if(!(*(physaddr_t *)(entry[i]) & PAGE_PRESENT)) { // TODO: missing the same flags condition: where to find these flags? in udata?
+
+	pt = KADDR(PAGE_ADDR(*entry));
+
+	/* The accessed and dirty bits are set by the MMU and can differ. */
+	flags = pt->entries[0] & PAGE_MASK & ~(PAGE_ACCESSED | PAGE_DIRTY);
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		if (!(pt->entries[i] & PAGE_PRESENT))
+			return 0;
+
+		if ((pt->entries[i] & PAGE_MASK & ~(PAGE_ACCESSED | PAGE_DIRTY))
+		    != flags)
 			return 0;
-		}
 	}
-	struct page_info *page = page_alloc(ALLOC_HUGE);
-	(page -> pp_ref) += 1;
-        *entry = page2pa(page) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER | PAGE_HUGE;
-	// TODO: how to set the flags
-	// free previously used pages
-	for(size_t i = 0; i < PAGE_SIZE / sizeof(physaddr_t); i++) {
-		if(!(*(physaddr_t *)(entry[i]) & PAGE_PRESENT)) {
-			page_free(pa2page(PAGE_ADDR(*(physaddr_t *)(entry[i]))));
-		}
+
+	huge = ptbl_contiguous(pt);
+
+	if (huge) {
+		*entry = page2pa(huge) | flags | PAGE_HUGE;
+		tlb_flush_range(info->pml4, va, va + HPAGE_SIZE - 1, PAGE_SIZE);
+
+		/* The first page takes over the reference of the mapping for
+		 * the whole order 9 page.
+		 */
+		for (i = 1; i < PAGE_TABLE_ENTRIES; ++i)
+			huge[i].pp_ref = 0;
+
+		huge->pp_order = BUDDY_2M_PAGE;
+		goto free_table;
 	}
-	// end
+
+	info->copy = true;
+
+	if (!info->may_copy)
+		return 0;
+
+	huge = page_alloc(info->alloc_flags | ALLOC_HUGE);
+
+	if (!huge)
+		return -1;
+
+	huge->pp_ref++;
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i)
+		copy_page((char *)page2kva(huge) + i * PAGE_SIZE,
+			KADDR(PAGE_ADDR(pt->entries[i])));
+
+	*entry = page2pa(huge) | flags | PAGE_HUGE;
+	tlb_flush_range(info->pml4, va, va + HPAGE_SIZE - 1, PAGE_SIZE);
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i)
+		page_decref(pa2page(PAGE_ADDR(pt->entries[i])));
+
+free_table:
+	page_decref(pa2page(PADDR(pt)));
+	ptbl_pages--;
+
 	return 0;
 }
 
-/* Frees up the page table by checking if all entries are clear. Returns if no
- * page table is present. Otherwise this function checks every entry in the
- * page table and frees the page table if no entry is set.
- *
- * Hint: this function calls pa2page(), page2kva() and page_free().
+/* Unlinks the page table below the entry if all of its entries are clear.
+ * Returns the page table, or NULL if no page table is present or if it is still
+ * in use. The caller has to flush the TLB before releasing the page table, as
+ * the paging-structure caches may still refer to it.
  */
-int ptbl_free(physaddr_t *entry, uintptr_t base, uintptr_t end,
-    struct page_walker *walker)
+struct page_info *ptbl_detach(physaddr_t *entry)
 {
-	/* LAB 2: your code here. */
-	// start
-	if(!(*entry & PAGE_PRESENT)) {
-		return 0;
+	struct page_table *pt;
+	struct page_info *table;
+	size_t i;
+
+	if (!(*entry & PAGE_PRESENT) || (*entry & PAGE_HUGE))
+		return NULL;
+
+	pt = KADDR(PAGE_ADDR(*entry));
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		if (pt->entries[i] & PAGE_PRESENT)
+			return NULL;
 	}
-	for(size_t i = 0; i < PAGE_SIZE / sizeof(physaddr_t); i++) {
-                if(*(physaddr_t *)(entry[i]) & PAGE_PRESENT) {
-                        return 0;
-                }
-        }
-	page_free(pa2page(PAGE_ADDR(*entry)));
-	// end
-	return 0;
+
+	table = pa2page(PAGE_ADDR(*entry));
+	*entry = 0;
+	ptbl_pages--;
+
+	return table;
 }
@@ -4,78 +4,196 @@
 #include <kernel/mem.h>
 
 struct remove_info {
-	struct page_table *pml4;
+	struct mmu_gather *tlb;
+	/* Page tables that span more than this are never freed. */
+	size_t max_span;
 };
 
-/* Removes the page if present by decrement the reference count, clearing the
- * PTE and invalidating the TLB.
+/* Removes the page if present by clearing the PTE and gathering the page, such
+ * that its reference count gets decremented once the TLB has been flushed.
  */
-static int remove_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
-    struct page_walker *walker)
+static __always_inline int remove_pte(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
 {
 	struct remove_info *info = walker->udata;
 	struct page_info *page;
 
-	/* LAB 2: your code here. */
-	// start
-	if(*entry & PAGE_PRESENT) {
-		page = pa2page(PAGE_ADDR(*entry));
-		page_decref(page);
-		// clear the PTE by setting it to NULL? not sure
-		*entry = 0;
-		tlb_invalidate(info -> pml4, page2kva(page));
-	}
-	// end
+	if (!(*entry & PAGE_PRESENT))
+		return 0;
+
+	page = pa2page(PAGE_ADDR(*entry));
+	*entry = 0;
+	tlb_gather_range(info->tlb, base, PAGE_SIZE);
+	tlb_gather_page(info->tlb, page);
+
 	return 0;
 }
 
-/* Removes the page if present and if it is a huge page by decrementing the
- * reference count, clearing the PDE and invalidating the TLB.
+/* Removes the huge page mapped by the PDE or the PDPTE if the range covers the
+ * whole huge page, by clearing the entry and gathering the huge page. If the
+ * range only covers part of the huge page, the huge page is split up into
+ * smaller pages instead, such that the walker removes the pages of the range
+ * one level down.
  */
-static int remove_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
-    struct page_walker *walker)
+static __always_inline int remove_huge(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker, size_t size)
 {
 	struct remove_info *info = walker->udata;
 	struct page_info *page;
 
-	/* LAB 2: your code here. */
-	// start
-	if(*entry & PAGE_PRESENT && *entry & PAGE_HUGE) {
-		page = pa2page(PAGE_ADDR(*entry));
-                page_decref(page);
-                // clear the PTE by setting it to NULL? not sure
-                *entry = 0;
-                tlb_invalidate(info -> pml4, page2kva(page));
+	if (!(*entry & PAGE_PRESENT) || !(*entry & PAGE_HUGE))
+		return 0;
+
+	if (base & (size - 1) || end - base + 1 != size) {
+		if (size == GPAGE_SIZE)
+			return pdir_split(entry, base, end, walker);
+
+		return ptbl_split(entry, base, end, walker);
 	}
-	// end
+
+	page = pa2page(PAGE_ADDR(*entry));
+	*entry = 0;
+	tlb_gather_range(info->tlb, base, size);
+	tlb_gather_page(info->tlb, page);
+
+	return 0;
+}
+
+static __always_inline int remove_pde(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
+{
+	return remove_huge(entry, base, end, walker, HPAGE_SIZE);
+}
+
+static __always_inline int remove_pdpte(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
+{
+	return remove_huge(entry, base, end, walker, GPAGE_SIZE);
+}
+
+/* Frees the page table spanning span bytes below the entry, once the walker
+ * has removed the pages below it and if no entry in the page table is in use
+ * anymore. Like the pages, the page table is gathered, as the TLB has to be
+ * flushed before it can be reused.
+ */
+static __always_inline int remove_ptbl(physaddr_t *entry, uintptr_t base,
+    struct page_walker *walker, size_t span)
+{
+	struct remove_info *info = walker->udata;
+	struct page_info *table;
+
+	if (span > info->max_span)
+		return 0;
+
+	table = ptbl_detach(entry);
+
+	if (!table)
+		return 0;
+
+	tlb_gather_table(info->tlb, base, table);
+
 	return 0;
 }
 
-/* Unmaps the range of pages from [va, va + size). */
-void unmap_page_range(struct page_table *pml4, void *va, size_t size)
+static __always_inline int remove_pt(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
+{
+	return remove_ptbl(entry, base, walker, PAGE_TABLE_SPAN);
+}
+
+static __always_inline int remove_pdir(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
+{
+	return remove_ptbl(entry, base, walker, PAGE_DIR_SPAN);
+}
+
+/* The PDPTs of the kernel half are shared by every PML4, so those are kept. */
+static __always_inline int remove_pdpt(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
+{
+	if (base >= USER_LIM)
+		return 0;
+
+	return remove_ptbl(entry, base, walker, PDPT_SPAN);
+}
+
+#define WALK_NAME        remove_walk
+#define WALK_PTE         remove_pte
+#define WALK_PDE         remove_pde
+#define WALK_PDPTE       remove_pdpte
+#define WALK_PDE_UNMAP   remove_pt
+#define WALK_PDPTE_UNMAP remove_pdir
+#define WALK_PML4E_UNMAP remove_pdpt
+#define WALK_PRESENT_ONLY
+#include <kernel/mem/walk_template.h>
+
+/* Unmaps the range of pages from [va, va + size), gathering the TLB
+ * invalidations and the pages to release into tlb. Page tables that span at
+ * most max_span bytes are freed on the way back up, if they end up empty. The
+ * caller flushes the gather with tlb_gather_flush().
+ *
+ * Returns 0 on success, or -1 if a huge page that only partially overlaps with
+ * the range cannot be split up, e.g. because it is shared. The pages before
+ * that huge page have been unmapped by then, but the huge page and the rest of
+ * the range are left alone.
+ */
+int unmap_page_range_tlb(struct mmu_gather *tlb, void *va, size_t size,
+    size_t max_span)
 {
-	/* LAB 2: your code here. */
 	struct remove_info info = {
-		.pml4 = pml4,
+		.tlb = tlb,
+		.max_span = max_span,
 	};
 	struct page_walker walker = {
-		.pte_callback = remove_pte,
-		.pde_callback = remove_pde,
-		/* LAB 2: your code here. */
 		.udata = &info,
 	};
 
-	walk_page_range(pml4, va, va + size, &walker);
+	int res;
+
+	if (size == 0)
+		return 0;
+
+	res = remove_walk(tlb->pml4, ROUNDDOWN((uintptr_t)va, PAGE_SIZE),
+		ROUNDUP((uintptr_t)va + size, PAGE_SIZE) - 1, &walker);
+
+	/* Splitting up huge pages at either end of the range changes the
+	 * entries that map the rest of the enclosing 1G regions.
+	 */
+	lookup_cache_invalidate(tlb->pml4, ROUNDDOWN((uintptr_t)va, GPAGE_SIZE),
+		ROUNDDOWN((uintptr_t)va + size - 1, GPAGE_SIZE) + GPAGE_SIZE - 1);
+
+	return res < 0 ? -1 : 0;
+}
+
+/* Unmaps the range of pages from [va, va + size) and frees the page tables
+ * that end up empty. The TLB gets flushed once for the whole range, after
+ * which the pages and the page tables are released.
+ *
+ * Returns 0 on success, or -1 if part of the range is still mapped, see
+ * unmap_page_range_tlb().
+ */
+int unmap_page_range(struct page_table *pml4, void *va, size_t size)
+{
+	struct mmu_gather tlb;
+	int res;
+
+	tlb_gather_init(&tlb, pml4);
+	res = unmap_page_range_tlb(&tlb, va, size, PDPT_SPAN);
+	tlb_gather_flush(&tlb);
+
+	return res;
 }
 
 /* Unmaps all user pages. */
-void unmap_user_pages(struct page_table *pml4)
+int unmap_user_pages(struct page_table *pml4)
 {
-	unmap_page_range(pml4, 0, USER_LIM);
+	return unmap_page_range(pml4, 0, USER_LIM);
 }
 
-/* Unmaps the physical page at the virtual address va. */
-void page_remove(struct page_table *pml4, void *va)
+/* Unmaps the physical page at the virtual address va. Fails if the page is
+ * part of a shared huge page.
+ */
+int page_remove(struct page_table *pml4, void *va)
 {
-	unmap_page_range(pml4, va, PAGE_SIZE);
+	return unmap_page_range(pml4, va, PAGE_SIZE);
 }
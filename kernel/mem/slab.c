@@ -0,0 +1,343 @@
+#include <types.h>
+#include <paging.h>
+#include <string.h>
+
+#include <kernel/mem.h>
+
+/* Marks the end of the list of free objects of a slab. */
+#define SLAB_NIL 0xfff
+
+static struct kmem_cache kmem_caches[KMEM_MAX_CACHES];
+static size_t kmem_ncaches;
+
+/* The caches backing kmalloc(), one for every power of two. */
+static struct kmem_cache *kmalloc_caches[KMALLOC_MAX_ORDER -
+	KMALLOC_MIN_ORDER + 1];
+
+static const char *kmalloc_names[] = {
+	"kmalloc-8", "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1k", "kmalloc-2k",
+};
+
+/* Only the boot CPU is running, so every cache has a single magazine. */
+static struct kmem_magazine *this_magazine(struct kmem_cache *cache)
+{
+	return &cache->magazine;
+}
+
+/* Returns the smallest order such that 2^order is at least size. */
+static size_t kmalloc_order(size_t size)
+{
+	if (size <= ((size_t)1 << KMALLOC_MIN_ORDER))
+		return KMALLOC_MIN_ORDER;
+
+	return 64 - __builtin_clzl(size - 1);
+}
+
+/*
+ * Creates a cache for objects of the given size, aligned to align bytes, which
+ * must be a power of two. Objects can be at most a page in size.
+ *
+ * Returns the cache or NULL if there are no caches left.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+	size_t align)
+{
+	struct kmem_cache *cache;
+
+	/* Free objects hold the index of the next free object. */
+	align = MAX(align, sizeof(uint16_t));
+	size = ROUNDUP(MAX(size, sizeof(uint16_t)), align);
+
+	if (size > PAGE_SIZE || kmem_ncaches >= KMEM_MAX_CACHES)
+		return NULL;
+
+	cache = kmem_caches + kmem_ncaches++;
+	cache->name = name;
+	cache->obj_size = size;
+	cache->nobjs = PAGE_SIZE / size;
+	page_list_init(&cache->empty);
+	page_list_init(&cache->partial);
+	page_list_init(&cache->full);
+
+	return cache;
+}
+
+/* Returns the list of slabs that the slab belongs on. */
+static struct page_list *slab_list(struct kmem_cache *cache,
+	struct page_info *slab)
+{
+	if (slab->pp_slab_inuse == 0)
+		return &cache->empty;
+
+	if (slab->pp_slab_inuse == cache->nobjs)
+		return &cache->full;
+
+	return &cache->partial;
+}
+
+/* Allocates a page for the cache and threads its objects onto a free list. */
+static struct page_info *slab_create(struct kmem_cache *cache)
+{
+	struct page_info *slab;
+	char *base;
+	size_t i;
+
+	slab = page_alloc(ALLOC_RECLAIMABLE);
+
+	if (!slab)
+		return NULL;
+
+	slab->pp_flags |= PP_SLAB;
+	slab->pp_slab_cache = cache - kmem_caches;
+	slab->pp_slab_inuse = 0;
+	slab->pp_slab_free = 0;
+
+	base = page2kva(slab);
+
+	for (i = 0; i < cache->nobjs; ++i) {
+		*(uint16_t *)(base + i * cache->obj_size) =
+			(i + 1 < cache->nobjs) ? i + 1 : SLAB_NIL;
+	}
+
+	page_list_add(&cache->empty, slab);
+	++cache->nslabs;
+
+	return slab;
+}
+
+/* Returns the slab to the buddy allocator. */
+static void slab_destroy(struct kmem_cache *cache, struct page_info *slab)
+{
+	page_list_del(&cache->empty, slab);
+	slab->pp_flags &= ~PP_SLAB;
+	slab->pp_private = 0;
+	--cache->nslabs;
+
+	page_free(slab);
+}
+
+/* Takes an object from a slab, preferring slabs that are partially used. */
+static void *slab_get_obj(struct kmem_cache *cache)
+{
+	struct page_info *slab;
+	struct page_list *list;
+	char *obj;
+
+	slab = page_list_first(&cache->partial);
+
+	if (!slab)
+		slab = page_list_first(&cache->empty);
+
+	if (!slab)
+		slab = slab_create(cache);
+
+	if (!slab)
+		return NULL;
+
+	list = slab_list(cache, slab);
+	obj = (char *)page2kva(slab) + slab->pp_slab_free * cache->obj_size;
+	slab->pp_slab_free = *(uint16_t *)obj;
+	++slab->pp_slab_inuse;
+	++cache->nactive;
+
+	if (slab_list(cache, slab) != list) {
+		page_list_del(list, slab);
+		page_list_add(slab_list(cache, slab), slab);
+	}
+
+	return obj;
+}
+
+/* Returns an object to its slab. Empty slabs are returned to the buddy
+ * allocator, except for one that is kept around for the next allocation.
+ */
+static void slab_put_obj(struct kmem_cache *cache, void *obj)
+{
+	struct page_info *slab;
+	struct page_list *list;
+	size_t idx;
+
+	slab = pa2page(PADDR(obj));
+	assert(slab->pp_flags & PP_SLAB);
+	assert(slab->pp_slab_cache == cache - kmem_caches);
+
+	list = slab_list(cache, slab);
+	idx = ((char *)obj - (char *)page2kva(slab)) / cache->obj_size;
+	*(uint16_t *)obj = slab->pp_slab_free;
+	slab->pp_slab_free = idx;
+	--slab->pp_slab_inuse;
+	--cache->nactive;
+
+	if (slab_list(cache, slab) != list) {
+		page_list_del(list, slab);
+		page_list_add(slab_list(cache, slab), slab);
+	}
+
+	if (slab->pp_slab_inuse == 0 &&
+	    page_list_first(&cache->empty) != page_list_last(&cache->empty))
+		slab_destroy(cache, slab);
+}
+
+/* Fills up half of the magazine with objects from the slabs. */
+static void kmem_magazine_refill(struct kmem_cache *cache,
+	struct kmem_magazine *mag)
+{
+	void *obj;
+
+	while (mag->count < KMEM_MAGAZINE_SIZE / 2 &&
+	       (obj = slab_get_obj(cache)))
+		mag->objs[mag->count++] = obj;
+}
+
+/* Returns the n least recently freed objects in the magazine to the slabs. */
+static void kmem_magazine_flush(struct kmem_cache *cache,
+	struct kmem_magazine *mag, size_t n)
+{
+	size_t i;
+
+	n = MIN(n, mag->count);
+
+	for (i = 0; i < n; ++i)
+		slab_put_obj(cache, mag->objs[i]);
+
+	mag->count -= n;
+	memmove(mag->objs, mag->objs + n, mag->count * sizeof *mag->objs);
+}
+
+/*
+ * Allocates an object from the cache. Objects are handed out from the
+ * magazine, which gets refilled from the slabs once it runs empty.
+ *
+ * if (alloc_flags & ALLOC_ZERO), clears the object.
+ *
+ * Returns NULL if out of free memory.
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache, int alloc_flags)
+{
+	struct kmem_magazine *mag = this_magazine(cache);
+	void *obj;
+
+	if (mag->count == 0)
+		kmem_magazine_refill(cache, mag);
+
+	if (mag->count == 0)
+		return NULL;
+
+	obj = mag->objs[--mag->count];
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(obj, 0, cache->obj_size);
+
+	return obj;
+}
+
+/* Returns the object to the cache. Once the magazine is full, half of it is
+ * returned to the slabs.
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+	struct kmem_magazine *mag = this_magazine(cache);
+
+	if (mag->count == KMEM_MAGAZINE_SIZE)
+		kmem_magazine_flush(cache, mag, KMEM_MAGAZINE_SIZE / 2);
+
+	mag->objs[mag->count++] = obj;
+}
+
+/* Returns the objects in the magazine as well as all empty slabs. */
+void kmem_cache_shrink(struct kmem_cache *cache)
+{
+	struct kmem_magazine *mag = this_magazine(cache);
+	struct page_info *slab;
+
+	kmem_magazine_flush(cache, mag, mag->count);
+
+	while ((slab = page_list_first(&cache->empty)))
+		slab_destroy(cache, slab);
+}
+
+/* Sets up the caches used by kmalloc(). */
+void kmem_init(void)
+{
+	size_t order;
+
+	for (order = KMALLOC_MIN_ORDER; order <= KMALLOC_MAX_ORDER; ++order) {
+		kmalloc_caches[order - KMALLOC_MIN_ORDER] = kmem_cache_create(
+			kmalloc_names[order - KMALLOC_MIN_ORDER],
+			(size_t)1 << order, (size_t)1 << order);
+	}
+}
+
+/*
+ * Allocates size bytes. Small sizes are rounded up to a power of two and
+ * served by the kmalloc caches, while larger sizes get a chunk of pages
+ * straight from the buddy allocator.
+ *
+ * if (alloc_flags & ALLOC_ZERO), clears the memory.
+ *
+ * Returns NULL if out of free memory.
+ */
+void *kmalloc(size_t size, int alloc_flags)
+{
+	struct page_info *page;
+	size_t order = kmalloc_order(size);
+
+	if (order <= KMALLOC_MAX_ORDER)
+		return kmem_cache_alloc(kmalloc_caches[order - KMALLOC_MIN_ORDER],
+			alloc_flags);
+
+	page = buddy_find(order - PAGE_TABLE_SHIFT);
+
+	if (!page)
+		return NULL;
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(page), 0, PAGE_SIZE << page->pp_order);
+
+	return page2kva(page);
+}
+
+/* Frees memory allocated by kmalloc(). */
+void kfree(void *obj)
+{
+	struct page_info *page;
+
+	if (!obj)
+		return;
+
+	page = pa2page(PADDR(obj));
+
+	if (page->pp_flags & PP_SLAB) {
+		kmem_cache_free(kmem_caches + page->pp_slab_cache, obj);
+		return;
+	}
+
+	assert(page_aligned((uintptr_t)obj));
+	page_free(page);
+}
+
+/* Shows the usage of every cache. Fragmentation is the share of the slabs
+ * that is not taken up by objects in use, including the free objects in the
+ * magazine.
+ */
+void show_kmem_info(void)
+{
+	struct kmem_cache *cache;
+	size_t i, ninuse, nbytes;
+
+	cprintf("Object caches:\n");
+
+	for (i = 0; i < kmem_ncaches; ++i) {
+		cache = kmem_caches + i;
+		ninuse = cache->nactive - cache->magazine.count;
+		nbytes = cache->nslabs * PAGE_SIZE;
+
+		cprintf("  %-12s size=%u objs=%u/%u slabs=%u magazine=%u "
+			"frag=%u%%\n",
+			cache->name, cache->obj_size, ninuse,
+			cache->nslabs * cache->nobjs, cache->nslabs,
+			cache->magazine.count,
+			nbytes ? 100 - ninuse * cache->obj_size * 100 / nbytes : 0);
+	}
+}
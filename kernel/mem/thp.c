@@ -0,0 +1,171 @@
+#include <types.h>
+#include <paging.h>
+
+#include <kernel/mem.h>
+
+/*
+ * Transparent huge page promotion collapses page tables of which all 512 PTEs
+ * map 4K pages with the same permissions into a single 2M page, such that the
+ * mapping takes up a single TLB entry rather than 512.
+ *
+ * The user address space of the kernel PML4 is scanned a few page tables at a
+ * time whenever the kernel is idle, picking up where the previous scan left
+ * off. Only pages that are mapped once can be promoted, as the copy in the
+ * huge page would otherwise no longer be shared with the other mappings. The
+ * kernel half is left alone, as its static mappings are not reference counted.
+ */
+
+/* Whether mem_idle() promotes page tables to huge pages. */
+bool thp_enabled = true;
+
+/* The maximum number of page tables to examine per call to thp_idle(). */
+size_t thp_scan_batch = 8;
+
+size_t thp_npromoted, thp_ndemoted;
+static size_t thp_ninplace, thp_nfailed;
+
+/* The user address at which the next scan continues. */
+static uintptr_t thp_cursor;
+
+struct thp_scan {
+	/* The number of page tables left to examine. */
+	size_t budget;
+	/* The address at which the next scan should continue. */
+	uintptr_t next;
+};
+
+/* Returns whether every PTE in the page table maps a 4K page that is mapped
+ * only once, with the same permissions as the other PTEs.
+ */
+static bool thp_can_promote(struct page_table *pt)
+{
+	struct page_info *page;
+	physaddr_t flags;
+	size_t i;
+
+	/* The accessed and dirty bits are set by the MMU and can differ. */
+	flags = pt->entries[0] & PAGE_MASK & ~(PAGE_ACCESSED | PAGE_DIRTY);
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		if (!(pt->entries[i] & PAGE_PRESENT))
+			return false;
+
+		if ((pt->entries[i] & PAGE_MASK & ~(PAGE_ACCESSED | PAGE_DIRTY))
+		    != flags)
+			return false;
+
+		if (PAGE_INDEX(PAGE_ADDR(pt->entries[i])) >= npages)
+			return false;
+
+		page = pa2page(PAGE_ADDR(pt->entries[i]));
+
+		if (page->pp_ref != 1 || page->pp_order != BUDDY_4K_PAGE)
+			return false;
+	}
+
+	return true;
+}
+
+/* Examines the page table below the PDE and promotes it to a huge page using
+ * ptbl_merge() if possible. Stops the walk once the budget runs out or after
+ * a single promotion attempt, to bound the work done per call. Page tables
+ * whose pages have to be copied are only promoted at the start of a scan.
+ */
+static int thp_scan_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	struct thp_scan *scan = walker->udata;
+	struct ptbl_merge_info info = {
+		.pml4 = kernel_pml4,
+		.alloc_flags = ALLOC_MOVABLE | ALLOC_NOCOMPACT,
+	};
+	struct page_walker merge = {
+		.udata = &info,
+	};
+	struct page_table *pt;
+	physaddr_t pa;
+
+	if (!(*entry & PAGE_PRESENT) || (*entry & PAGE_HUGE))
+		return 0;
+
+	if (scan->budget == 0) {
+		scan->next = base;
+		return -1;
+	}
+
+	pt = KADDR(PAGE_ADDR(*entry));
+
+	if (!thp_can_promote(pt)) {
+		scan->budget--;
+		return 0;
+	}
+
+	/* Copying the pages costs as much as examining a whole batch of page
+	 * tables, so only do so for the first page table of a scan. The huge
+	 * page is only mapped by the PDE, so it can be migrated, but memory is
+	 * never compacted to get one.
+	 */
+	info.may_copy = scan->budget == thp_scan_batch;
+	scan->budget--;
+	pa = PAGE_ADDR(pt->entries[0]);
+	ptbl_merge(entry, base, end, &merge);
+
+	/* Leave the copy to the next scan, which starts at this page table. */
+	if (info.copy && !info.may_copy) {
+		scan->next = base;
+		return -1;
+	}
+
+	if (!(*entry & PAGE_HUGE)) {
+		thp_nfailed++;
+	} else {
+		thp_npromoted++;
+
+		/* ptbl_merge() reuses the pages if they are contiguous. */
+		if (PAGE_ADDR(*entry) == pa)
+			thp_ninplace++;
+	}
+
+	scan->next = end + 1;
+	return -1;
+}
+
+/*
+ * Scans up to thp_scan_batch page tables in the user address space of the
+ * kernel PML4 and promotes at most one of them to a huge page. This is meant
+ * to be called whenever the kernel is idle.
+ *
+ * Returns the number of page tables that got promoted.
+ */
+size_t thp_idle(void)
+{
+	struct thp_scan scan = {
+		.budget = thp_scan_batch,
+		.next = USER_LIM,
+	};
+	struct page_walker walker = {
+		.pde_callback = thp_scan_pde,
+		.udata = &scan,
+		.present_only = true,
+	};
+	size_t npromoted = thp_npromoted;
+
+	if (!thp_enabled || !kernel_pml4)
+		return 0;
+
+	walk_page_range(kernel_pml4, (void *)thp_cursor, (void *)USER_LIM,
+		&walker);
+
+	/* Start over once the whole user address space has been scanned. */
+	thp_cursor = scan.next < USER_LIM ? scan.next : 0;
+
+	return thp_npromoted - npromoted;
+}
+
+void show_thp_info(void)
+{
+	cprintf("Huge page promotion: %s, %u page tables per scan\n",
+		thp_enabled ? "on" : "off", thp_scan_batch);
+	cprintf("  %u promoted (%u in place), %u demoted, %u failed\n",
+		thp_npromoted, thp_ninplace, thp_ndemoted, thp_nfailed);
+}
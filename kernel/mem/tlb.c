@@ -1,22 +1,380 @@
 #include <types.h>
 #include <paging.h>
 
+#include <x86-64/asm.h>
+
 #include <kernel/mem.h>
 
-/* Invalidate a TLB entry, but only if the page tables being modified are the
- * ones currently in use by the processor.
+/*
+ * Flushing more pages than this at once reloads CR3 instead, as a single full
+ * flush is cheaper than that many invlpg instructions.
+ */
+size_t tlb_flush_ceiling = 32;
+
+/*
+ * The PCIDs handed out to PML4s. PCID 0 is never handed out, such that it
+ * denotes a PML4 without a PCID. A PCID is stale if the page tables have been
+ * modified while the PML4 was not live, in which case the TLB entries tagged
+ * with the PCID have to be flushed the next time the PML4 gets loaded.
+ */
+struct pcid_slot {
+	physaddr_t root;
+	bool stale;
+};
+
+static struct pcid_slot pcid_slots[PCID_COUNT];
+static size_t pcid_next = 1;
+
+/* Returns whether the PML4 is the one currently in use by the processor. */
+static bool pml4_is_live(struct page_table *pml4)
+{
+	return PAGE_ADDR(read_cr3()) == PADDR(pml4);
+}
+
+/* Returns the PCID tagging the PML4, or 0 if it has none. */
+static size_t pcid_lookup(physaddr_t root)
+{
+	size_t pcid;
+
+	for (pcid = 1; pcid < PCID_COUNT; ++pcid) {
+		if (pcid_slots[pcid].root == root)
+			return pcid;
+	}
+
+	return 0;
+}
+
+/* Hands out the next PCID in round-robin order, skipping the live one. The
+ * PCID starts out stale, as the TLB may still hold entries of its previous
+ * owner.
+ */
+static size_t pcid_assign(physaddr_t root)
+{
+	size_t live = read_cr3() & CR3_PCID_MASK;
+	size_t pcid = pcid_next;
+
+	if (pcid == live)
+		pcid = pcid % (PCID_COUNT - 1) + 1;
+
+	pcid_next = pcid % (PCID_COUNT - 1) + 1;
+	pcid_slots[pcid].root = root;
+	pcid_slots[pcid].stale = true;
+
+	return pcid;
+}
+
+/* Marks the PCID of a PML4 that is not live as stale, if it has one. */
+static void pcid_mark_stale(struct page_table *pml4)
+{
+	size_t pcid;
+
+	if (!pcid_supported)
+		return;
+
+	pcid = pcid_lookup(PADDR(pml4));
+
+	if (pcid)
+		pcid_slots[pcid].stale = true;
+}
+
+/* Loads the PML4. If the CPU supports PCIDs, the PML4 is tagged with a PCID and
+ * loaded without flushing the TLB, unless its PCID is stale. The TLB entries
+ * of other PML4s then survive the switch.
+ */
+void tlb_switch_pml4(struct page_table *pml4)
+{
+	physaddr_t root = PADDR(pml4);
+	uint64_t cr3;
+	size_t pcid;
+
+	if (!pcid_supported) {
+		load_pml4((struct page_table *)root);
+		return;
+	}
+
+	pcid = pcid_lookup(root);
+
+	if (!pcid)
+		pcid = pcid_assign(root);
+
+	cr3 = root | pcid;
+
+	if (!pcid_slots[pcid].stale)
+		cr3 |= CR3_NOFLUSH;
+
+	pcid_slots[pcid].stale = false;
+	write_cr3(cr3);
+}
+
+/* Drops the PCID of the PML4, if any. Must be called before a PML4 that has
+ * been loaded gets freed, such that the next owner of the PCID starts out with
+ * a flush.
+ */
+void tlb_release_pml4(struct page_table *pml4)
+{
+	size_t pcid;
+
+	if (!pcid_supported)
+		return;
+
+	pcid = pcid_lookup(PADDR(pml4));
+
+	if (pcid)
+		pcid_slots[pcid].root = 0;
+}
+
+/* Flushes the entire TLB, including the global entries of the kernel mappings
+ * and the entries of every PCID, by toggling CR4.PGE. Without global pages,
+ * every PCID is marked as stale and CR3 is reloaded instead.
+ */
+void tlb_flush_global(void)
+{
+	uintptr_t cr4 = read_cr4();
+	size_t pcid;
+
+	if (!(cr4 & CR4_PGE)) {
+		for (pcid = 1; pcid < PCID_COUNT; ++pcid)
+			pcid_slots[pcid].stale = true;
+
+		write_cr3(read_cr3());
+		return;
+	}
+
+	write_cr4(cr4 & ~CR4_PGE);
+	write_cr4(cr4);
+}
+
+/* Invalidate a TLB entry if the page tables being modified are the ones
+ * currently in use by the processor. Otherwise the PCID of the PML4, if any, is
+ * marked as stale. As kernel mappings are global and shared by every address
+ * space, they are always invalidated. The cached translation of page_lookup()
+ * is dropped either way.
  *
- * Hint: this function calls flush_page().
+ * This only drops the paging-structure caches of the current PCID. Before a
+ * page table of the kernel half can be freed, tlb_flush_global() has to be
+ * called, as the other PCIDs may still walk through it.
  */
 void tlb_invalidate(struct page_table *pml4, void *va)
 {
-	/* Flush the entry only if we are modifying the current address space.
-	 *
-	 * Note: for now, there is only one address space, so always invalidate.
-	 */
-	/* LAB 2: your code here. */
-	// I didn't truely understand the part "only if the page tables being modified" and "always invalidate"
-	// So this might be wrong
-	flush_page(va);
+	lookup_cache_invalidate(pml4, (uintptr_t)va, (uintptr_t)va);
+
+	if (pml4_is_live(pml4) || (uintptr_t)va >= USER_LIM)
+		flush_page(va);
+	else
+		pcid_mark_stale(pml4);
 }
 
+/* Invalidates the TLB entries for the pages in [start, end], of which the
+ * smallest is stride bytes. Falls back to a full flush if that means more
+ * than tlb_flush_ceiling pages: a CR3 reload for user mappings, or
+ * tlb_flush_global() if the range includes global kernel mappings.
+ *
+ * User mappings are only flushed if the PML4 is currently in use. If it is
+ * not, its PCID is marked as stale instead. The cached translations of
+ * page_lookup() are dropped either way.
+ *
+ * Like tlb_invalidate(), this does not cover page tables of the kernel half
+ * that are about to be freed, see tlb_gather_table().
+ */
+void tlb_flush_range(struct page_table *pml4, uintptr_t start, uintptr_t end,
+	size_t stride)
+{
+	uintptr_t va;
+
+	if (start > end)
+		return;
+
+	lookup_cache_invalidate(pml4, start, end);
+
+	if (!pml4_is_live(pml4)) {
+		pcid_mark_stale(pml4);
+		start = MAX(start, USER_LIM);
+
+		if (start > end)
+			return;
+	}
+
+	if ((end - start) / stride >= tlb_flush_ceiling) {
+		if (end >= USER_LIM)
+			tlb_flush_global();
+		else
+			write_cr3(read_cr3());
+
+		return;
+	}
+
+	for (va = start; va <= end && va >= start; va += stride)
+		flush_page((void *)va);
+}
+
+/* Sets up an empty gather for changes to the given PML4. */
+void tlb_gather_init(struct mmu_gather *tlb, struct page_table *pml4)
+{
+	tlb->pml4 = pml4;
+	tlb->start = KERNEL_LIM;
+	tlb->end = 0;
+	tlb->stride = GPAGE_SIZE;
+	tlb->flush_global = false;
+	tlb->npages = 0;
+}
+
+/* Adds the page of size bytes mapped at va to the range to invalidate. */
+void tlb_gather_range(struct mmu_gather *tlb, uintptr_t va, size_t size)
+{
+	tlb->start = MIN(tlb->start, va);
+	tlb->end = MAX(tlb->end, va + size - 1);
+	tlb->stride = MIN(tlb->stride, size);
+}
+
+/* Drops a reference to the page once the TLB has been flushed. */
+void tlb_gather_page(struct mmu_gather *tlb, struct page_info *page)
+{
+	tlb->pages[tlb->npages++] = page;
+
+	if (tlb->npages == TLB_GATHER_PAGES)
+		tlb_gather_flush(tlb);
+}
+
+/* Drops a reference to the page table that has been detached from the entry
+ * mapping va once the TLB has been flushed. The page tables of the kernel half
+ * are shared by every PML4, such that the paging-structure caches of any PCID
+ * may still refer to them. Those get flushed using tlb_flush_global().
+ */
+void tlb_gather_table(struct mmu_gather *tlb, uintptr_t va,
+	struct page_info *table)
+{
+	if (va >= USER_LIM)
+		tlb->flush_global = true;
+
+	tlb_gather_range(tlb, va, PAGE_SIZE);
+	tlb_gather_page(tlb, table);
+}
+
+/* Flushes the gathered range from the TLB and only then drops the references
+ * to the gathered pages. The gather can be used again afterwards.
+ */
+void tlb_gather_flush(struct mmu_gather *tlb)
+{
+	size_t i;
+
+	tlb_flush_range(tlb->pml4, tlb->start, tlb->end, tlb->stride);
+
+	if (tlb->flush_global)
+		tlb_flush_global();
+
+	for (i = 0; i < tlb->npages; ++i)
+		page_decref(tlb->pages[i]);
+
+	tlb_gather_init(tlb, tlb->pml4);
+}
+
+/* Touches every page in [base, base + npages * PAGE_SIZE) and returns the
+ * number of cycles it took.
+ */
+static uint64_t tlb_bench_touch(uintptr_t base, size_t npages)
+{
+	volatile char *p = (volatile char *)base;
+	uint64_t start = read_tsc();
+	size_t i;
+
+	for (i = 0; i < npages; ++i)
+		(void)p[i * PAGE_SIZE];
+
+	return read_tsc() - start;
+}
+
+/* Sets up a PML4 that shares the kernel half of the kernel PML4. */
+static struct page_table *tlb_bench_pml4(void)
+{
+	struct page_info *page = page_alloc(ALLOC_ZERO);
+	struct page_table *pml4;
+	size_t i;
+
+	if (!page)
+		return NULL;
+
+	page->pp_ref++;
+	pml4 = page2kva(page);
+	ptbl_pages++;
+
+	for (i = PML4_INDEX(USER_LIM); i < PAGE_TABLE_ENTRIES; ++i)
+		pml4->entries[i] = kernel_pml4->entries[i];
+
+	return pml4;
+}
+
+/* Unmaps the user half of a PML4 set up by tlb_bench_pml4() and frees it. */
+static void tlb_bench_free(struct page_table *pml4)
+{
+	tlb_release_pml4(pml4);
+	unmap_user_pages(pml4);
+	page_decref(pa2page(PADDR(pml4)));
+	ptbl_pages--;
+}
+
+/*
+ * Measures the cost of refilling the TLB after an address space switch. Two
+ * PML4s are set up, of which the first one maps npages pages at
+ * TLB_BENCH_BASE. Every round switches to the second PML4 and back, and then
+ * touches the pages, once with the tagged switch of tlb_switch_pml4() and once
+ * with a full flush after the switch, as without PCIDs.
+ */
+void tlb_benchmark(size_t npages, size_t rounds)
+{
+	struct page_table *a, *b;
+	struct page_info *page;
+	uint64_t tagged = 0, flushed = 0;
+	size_t i;
+
+	a = tlb_bench_pml4();
+	b = tlb_bench_pml4();
+
+	if (!a || !b) {
+		cprintf("tlb benchmark: out of memory\n");
+		goto out;
+	}
+
+	for (i = 0; i < npages; ++i) {
+		page = page_alloc(0);
+
+		if (!page || page_insert(a, page,
+		    (void *)(TLB_BENCH_BASE + i * PAGE_SIZE),
+		    PAGE_WRITE | PAGE_NO_EXEC) < 0) {
+			if (page)
+				page_free(page);
+
+			cprintf("tlb benchmark: out of memory\n");
+			goto out;
+		}
+	}
+
+	tlb_switch_pml4(a);
+	tlb_bench_touch(TLB_BENCH_BASE, npages);
+
+	for (i = 0; i < rounds; ++i) {
+		tlb_switch_pml4(b);
+		tlb_switch_pml4(a);
+		tagged += tlb_bench_touch(TLB_BENCH_BASE, npages);
+	}
+
+	for (i = 0; i < rounds; ++i) {
+		tlb_switch_pml4(b);
+		tlb_switch_pml4(a);
+		write_cr3(read_cr3());
+		flushed += tlb_bench_touch(TLB_BENCH_BASE, npages);
+	}
+
+	tlb_switch_pml4(kernel_pml4);
+
+	cprintf("tlb benchmark: %u pages, %u rounds, PCID %s\n", npages, rounds,
+		pcid_supported ? "enabled" : "not supported");
+	cprintf("  tagged switch:  %u cycles per round\n", tagged / rounds);
+	cprintf("  flushed switch: %u cycles per round\n", flushed / rounds);
+
+out:
+	if (a)
+		tlb_bench_free(a);
+
+	if (b)
+		tlb_bench_free(b);
+}
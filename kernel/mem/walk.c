@@ -3,34 +3,15 @@
 
 #include <kernel/mem.h>
 
-/* Given an address addr, this function returns the sign extended address. */
-static uintptr_t sign_extend(uintptr_t addr)
-{
-	return (addr < USER_LIM) ? addr : (0xffff000000000000ull | addr);
-}
-
-/* Given an addresss addr, this function returns the page boundary. */
-static uintptr_t ptbl_end(uintptr_t addr)
-{
-	return addr | (PAGE_SIZE - 1);
-}
-
-/* Given an address addr, this function returns the page table boundary. */
-static uintptr_t pdir_end(uintptr_t addr)
-{
-	return addr | (PAGE_TABLE_SPAN - 1);
-}
-
-/* Given an address addr, this function returns the page directory boundary. */
-static uintptr_t pdpt_end(uintptr_t addr)
+/* Reports the pending hole of a present-only walk, before calling any of the
+ * other callbacks.
+ */
+static int walk_hole_sync(struct page_walker *walker)
 {
-	return addr | (PAGE_DIR_SPAN - 1);
-}
+	if (!walker->present_only || !walker->pt_hole_callback)
+		return 0;
 
-/* Given an address addr, this function returns the PDPT boundary. */
-static uintptr_t pml4_end(uintptr_t addr)
-{
-	return addr | (PDPT_SPAN - 1);
+	return walk_hole_flush(walker, walker->pt_hole_callback);
 }
 
 /* Walks over the page range from base to end iterating over the entries in the
@@ -39,34 +20,52 @@ static uintptr_t pml4_end(uintptr_t addr)
  * walker->pt_hole_callback() that gets called for every unmapped entry in the page
  * table.
  *
- * Hint: this function calls ptbl_end() to get the end boundary of the current
- * page.
- * Hint: the next page is at ptbl_end() + 1.
- * Hint: the loop condition is next < end.
+ * The range passed to the callbacks is clipped to [base, end], such that a
+ * walk over a single page only visits the entries for that page.
  */
 static int ptbl_walk_range(struct page_table *ptbl, uintptr_t base,
     uintptr_t end, struct page_walker *walker)
 {
-	/* LAB 2: your code here. */
-	// start
-	uintptr_t next;
-	int res = 0;
 	physaddr_t *entry;
-	for(next = base; next < end; next = ptbl_end(next) + 1) {
-		entry = ptbl -> entries + PAGE_TABLE_INDEX(next);
-		if(walker -> pte_callback) {
-			res = walker -> pte_callback(entry, next, ptbl_end(next), walker);
-			if(res < 0)
+	uintptr_t next, next_end;
+	int res;
+
+	for (next = base; ; next = next_end + 1) {
+		if (walker->present_only) {
+			res = walk_skip_holes(ptbl, &next, end, PAGE_TABLE_SHIFT,
+				walker, walker->pt_hole_callback);
+
+			if (res <= 0)
+				return res;
+		}
+
+		next_end = MIN(ptbl_end(next), end);
+		entry = ptbl->entries + PAGE_TABLE_INDEX(next);
+
+		if (walker->pte_callback) {
+			res = walk_hole_sync(walker);
+
+			if (res < 0)
+				return res;
+
+			res = walker->pte_callback(entry, next, next_end, walker);
+
+			if (res < 0)
 				return res;
 		}
 
-		if(walker -> pt_hole_callback && !(PAGE_PRESENT & (*entry))) {
-			res = walker -> pt_hole_callback(next, ptbl_end(next), walker);
-			if(res < 0)
+		if (walker->pt_hole_callback && !walker->present_only &&
+		    !(*entry & PAGE_PRESENT)) {
+			res = walker->pt_hole_callback(next, next_end, walker);
+
+			if (res < 0)
 				return res;
 		}
+
+		if (next_end == end)
+			break;
 	}
-	// end
+
 	return 0;
 }
 
@@ -78,43 +77,71 @@ static int ptbl_walk_range(struct page_table *ptbl, uintptr_t base,
  * calls ptbl_walk_range() to iterate over the entries in the page table. The
  * user may provide walker->pde_unmap() that gets called for every present PDE
  * after walking over the page table.
- *
- * Hint: see ptbl_walk_range().
  */
 static int pdir_walk_range(struct page_table *pdir, uintptr_t base,
     uintptr_t end, struct page_walker *walker)
 {
-	/* LAB 2: your code here. */
-	// start
-	int res = 0;
-	physaddr_t *entry;
-	uintptr_t next;
 	struct page_table *ptbl;
-	for(next = base; next < end; next = pdir_end(next) + 1) {
-		entry = pdir -> entries + PAGE_DIR_INDEX(next);
-		if(walker -> pde_callback) {
-			res = walker -> pde_callback(entry, next, pdir_end(next), walker);
-                        if(res < 0)
-                                return res;
-		}
-		if(walker -> pt_hole_callback && !(PAGE_PRESENT & (*entry))) {
-                        res = walker -> pt_hole_callback(next, pdir_end(next), walker);
-                        if(res < 0)
-                                return res;
-                }
-		if(PAGE_PRESENT & (*entry) && !(PAGE_HUGE & (*entry))) {
-			ptbl = (struct page_table *)PAGE_ADDR(*entry);
-			res = ptbl_walk_range(ptbl, next, pdir_end(next), walker);
-			if(res < 0)
-                                return res;
-		}
-		if(walker -> pde_unmap && PAGE_PRESENT & (*entry)) {
-			res = walker -> pde_unmap(entry, next, pdir_end(next), walker);
-			if(res < 0)
-                                return res;
+	physaddr_t *entry;
+	uintptr_t next, next_end;
+	int res;
+
+	for (next = base; ; next = next_end + 1) {
+		if (walker->present_only) {
+			res = walk_skip_holes(pdir, &next, end, PAGE_DIR_SHIFT,
+				walker, walker->pt_hole_callback);
+
+			if (res <= 0)
+				return res;
+		}
+
+		next_end = MIN(pdir_end(next), end);
+		entry = pdir->entries + PAGE_DIR_INDEX(next);
+
+		if (walker->pde_callback) {
+			res = walk_hole_sync(walker);
+
+			if (res < 0)
+				return res;
+
+			res = walker->pde_callback(entry, next, next_end, walker);
+
+			if (res < 0)
+				return res;
 		}
+
+		if (walker->pt_hole_callback && !walker->present_only &&
+		    !(*entry & PAGE_PRESENT)) {
+			res = walker->pt_hole_callback(next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+
+		if ((*entry & PAGE_PRESENT) && !(*entry & PAGE_HUGE)) {
+			ptbl = KADDR(PAGE_ADDR(*entry));
+			res = ptbl_walk_range(ptbl, next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+
+		if (walker->pde_unmap && (*entry & PAGE_PRESENT)) {
+			res = walk_hole_sync(walker);
+
+			if (res < 0)
+				return res;
+
+			res = walker->pde_unmap(entry, next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+
+		if (next_end == end)
+			break;
 	}
-	// end
+
 	return 0;
 }
 
@@ -122,47 +149,75 @@ static int pdir_walk_range(struct page_table *pdir, uintptr_t base,
  * given PDPT pdpt. The user may provide walker->pdpte_callback() that gets called
  * for every entry in the PDPT. In addition the user may provide
  * walker->pt_hole_callback() that gets called for every unmapped entry in the PDPT. If
- * the PDPTE is present, but not a large page, this function calls
+ * the PDPTE is present, but not a 1G page, this function calls
  * pdir_walk_range() to iterate over the entries in the page directory. The
  * user may provide walker->pdpte_unmap() that gets called for every present
  * PDPTE after walking over the page directory.
- *
- * Hint: see ptbl_walk_range().
  */
 static int pdpt_walk_range(struct page_table *pdpt, uintptr_t base,
     uintptr_t end, struct page_walker *walker)
 {
-	/* LAB 2: your code here. */
-	// start
-	int res = 0;
-        physaddr_t *entry;
-        uintptr_t next;
-        struct page_table *pdir;
-	for(next = base; next < end; next = pdpt_end(next) + 1) {
-		entry = pdpt -> entries + PDPT_INDEX(next);
-		if(walker -> pdpte_callback) {
-			res = walker -> pdpte_callback(entry, next, pdpt_end(next), walker);
-			if(res < 0)
-                                return res;
-		}
-		if(walker -> pt_hole_callback && !(PAGE_PRESENT & (*entry))) {
-                        res = walker -> pt_hole_callback(next, pdpt_end(next), walker);
-                        if(res < 0)
-                                return res;
-		}
-		if(PAGE_PRESENT & (*entry) && !(PAGE_HUGE & (*entry))) {
-                        pdir = (struct page_table *)PAGE_ADDR(*entry);
-                        res = pdir_walk_range(pdir, next, pdpt_end(next), walker);
-                        if(res < 0)
-                                return res;
-                }
-                if(walker -> pdpte_unmap && PAGE_PRESENT & (*entry)) {
-                        res = walker -> pdpte_unmap(entry, next, pdpt_end(next), walker);
-                        if(res < 0)
-                                return res;
-                }
+	struct page_table *pdir;
+	physaddr_t *entry;
+	uintptr_t next, next_end;
+	int res;
+
+	for (next = base; ; next = next_end + 1) {
+		if (walker->present_only) {
+			res = walk_skip_holes(pdpt, &next, end, PDPT_SHIFT,
+				walker, walker->pt_hole_callback);
+
+			if (res <= 0)
+				return res;
+		}
+
+		next_end = MIN(pdpt_end(next), end);
+		entry = pdpt->entries + PDPT_INDEX(next);
+
+		if (walker->pdpte_callback) {
+			res = walk_hole_sync(walker);
+
+			if (res < 0)
+				return res;
+
+			res = walker->pdpte_callback(entry, next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+
+		if (walker->pt_hole_callback && !walker->present_only &&
+		    !(*entry & PAGE_PRESENT)) {
+			res = walker->pt_hole_callback(next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+
+		if ((*entry & PAGE_PRESENT) && !(*entry & PAGE_HUGE)) {
+			pdir = KADDR(PAGE_ADDR(*entry));
+			res = pdir_walk_range(pdir, next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+
+		if (walker->pdpte_unmap && (*entry & PAGE_PRESENT)) {
+			res = walk_hole_sync(walker);
+
+			if (res < 0)
+				return res;
+
+			res = walker->pdpte_unmap(entry, next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+
+		if (next_end == end)
+			break;
 	}
-	// end
+
 	return 0;
 }
 
@@ -174,42 +229,86 @@ static int pdpt_walk_range(struct page_table *pdpt, uintptr_t base,
  * the entries in the PDPT. The user may provide walker->pml4e_unmap() that
  * gets called for every present PML4E after walking over the PDPT.
  *
- * Hint: see ptbl_walk_range().
+ * The non-canonical hole between USER_LIM and the kernel half is skipped.
+ *
+ * If walker->present_only is set, every level only visits the present entries
+ * and skips over the others using walk_skip_holes(), such that the cost of the
+ * walk depends on what is mapped rather than on the size of the range. The
+ * skipped entries are reported to walker->pt_hole_callback() as maximal ranges,
+ * rather than one call per entry.
  */
 static int pml4_walk_range(struct page_table *pml4, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
-	/* LAB 2: your code here. */
-	// start
-	int res = 0;
-        physaddr_t *entry;
-        uintptr_t next;
-        struct page_table *pdpt;
-	for(next = base; next < end; next = pml4_end(next) + 1) {
-		entry = pml4 -> entries + PML4_INDEX(next);
-                if(walker -> pml4e_callback) {
-                        res = walker -> pml4e_callback(entry, next, pml4_end(next), walker);
-                        if(res < 0)
-                                return res;
-                }
-                if(walker -> pt_hole_callback && !(PAGE_PRESENT & *entry)) {
-                        res = walker -> pt_hole_callback(next, pml4_end(next), walker);
-                        if(res < 0)
-                                return res;
-                }
-                if(PAGE_PRESENT & (*entry) && !(PAGE_HUGE & (*entry))) {
-                        pdpt = (struct page_table *)PAGE_ADDR(*entry);
-                        res = pdpt_walk_range(pdpt, next, pml4_end(next), walker);
-                        if(res < 0)
-                                return res;
-                }
-                if(walker -> pml4e_unmap && PAGE_PRESENT & (*entry)) {
-                        res = walker -> pml4e_unmap(entry, next, pml4_end(next), walker);
-                        if(res < 0)
-                                return res;
-                }
+	struct page_table *pdpt;
+	physaddr_t *entry;
+	uintptr_t next, next_end;
+	int res;
+
+	walker->hole_pending = false;
+
+	for (next = base; next <= end; next = sign_extend(next_end + 1)) {
+		if (walker->present_only) {
+			res = walk_skip_holes(pml4, &next, end, PML4_SHIFT,
+				walker, walker->pt_hole_callback);
+
+			if (res < 0)
+				return res;
+
+			if (res == 0)
+				break;
+		}
+
+		next_end = MIN(pml4_end(next), end);
+		entry = pml4->entries + PML4_INDEX(next);
+
+		if (walker->pml4e_callback) {
+			res = walk_hole_sync(walker);
+
+			if (res < 0)
+				return res;
+
+			res = walker->pml4e_callback(entry, next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+
+		if (walker->pt_hole_callback && !walker->present_only &&
+		    !(*entry & PAGE_PRESENT)) {
+			res = walker->pt_hole_callback(next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+
+		if (*entry & PAGE_PRESENT) {
+			pdpt = KADDR(PAGE_ADDR(*entry));
+			res = pdpt_walk_range(pdpt, next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+
+		if (walker->pml4e_unmap && (*entry & PAGE_PRESENT)) {
+			res = walk_hole_sync(walker);
+
+			if (res < 0)
+				return res;
+
+			res = walker->pml4e_unmap(entry, next, next_end, walker);
+
+			if (res < 0)
+				return res;
+		}
+
+		if (next_end == end)
+			break;
 	}
-	// end
+
+	if (walker->present_only && walker->pt_hole_callback)
+		return walk_hole_flush(walker, walker->pt_hole_callback);
+
 	return 0;
 }
 
@@ -232,7 +331,7 @@ int walk_all_pages(struct page_table *pml4, struct page_walker *walker)
 /* Helper function to walk over all user pages. */
 int walk_user_pages(struct page_table *pml4, struct page_walker *walker)
 {
-	return pml4_walk_range(pml4, 0, USER_LIM, walker);
+	return pml4_walk_range(pml4, 0, USER_LIM - 1, walker);
 }
 
 /* Helper function to walk over all kernel pages. */
@@ -241,3 +340,111 @@ int walk_kernel_pages(struct page_table *pml4, struct page_walker *walker)
 	return pml4_walk_range(pml4, KERNEL_VMA, KERNEL_LIM, walker);
 }
 
+
+/* Counts the present pages, including huge pages, for walk_benchmark(). */
+static __always_inline int walk_count_pte(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
+{
+	size_t *count = walker->udata;
+
+	if (*entry & PAGE_PRESENT)
+		++*count;
+
+	return 0;
+}
+
+static __always_inline int walk_count_huge(physaddr_t *entry, uintptr_t base,
+    uintptr_t end, struct page_walker *walker)
+{
+	size_t *count = walker->udata;
+
+	if ((*entry & PAGE_PRESENT) && (*entry & PAGE_HUGE))
+		++*count;
+
+	return 0;
+}
+
+#define WALK_NAME  walk_count
+#define WALK_PTE   walk_count_pte
+#define WALK_PDE   walk_count_huge
+#define WALK_PDPTE walk_count_huge
+#include <kernel/mem/walk_template.h>
+
+#define WALK_NAME  walk_count_present
+#define WALK_PTE   walk_count_pte
+#define WALK_PDE   walk_count_huge
+#define WALK_PDPTE walk_count_huge
+#define WALK_PRESENT_ONLY
+#include <kernel/mem/walk_template.h>
+
+/* Prints the cycles per walk and whether the walk counted npages pages. */
+static void walk_bench_report(const char *name, uint64_t cycles,
+    size_t count, size_t npages, size_t rounds)
+{
+	cprintf("  %-28s %u cycles per walk%s\n", name, cycles / rounds,
+		count == npages * rounds ? "" : " (page count mismatch)");
+}
+
+/*
+ * Measures the cycles per walk over the kernel half of kernel_pml4 for the
+ * given number of rounds, using the generic page walker and a walker generated
+ * from walk_template.h, both with and without skipping the holes. All of them
+ * count the present pages, which should yield the same number.
+ */
+void walk_benchmark(size_t rounds)
+{
+	uint64_t start, generic, special, generic_present, special_present;
+	size_t i, npages = 0, count = 0;
+	struct page_walker walker = {
+		.pte_callback = walk_count_pte,
+		.pde_callback = walk_count_huge,
+		.pdpte_callback = walk_count_huge,
+		.udata = &npages,
+	};
+
+	walk_kernel_pages(kernel_pml4, &walker);
+	walker.udata = &count;
+
+	start = read_tsc();
+
+	for (i = 0; i < rounds; ++i)
+		walk_kernel_pages(kernel_pml4, &walker);
+
+	generic = read_tsc() - start;
+
+	cprintf("walk benchmark: %u pages, %u rounds\n", npages, rounds);
+	walk_bench_report("generic walker:", generic, count, npages, rounds);
+
+	count = 0;
+	walker.present_only = true;
+	start = read_tsc();
+
+	for (i = 0; i < rounds; ++i)
+		walk_kernel_pages(kernel_pml4, &walker);
+
+	generic_present = read_tsc() - start;
+	walk_bench_report("generic present-only walker:", generic_present,
+		count, npages, rounds);
+
+	count = 0;
+	walker = (struct page_walker){ .udata = &count };
+	start = read_tsc();
+
+	for (i = 0; i < rounds; ++i)
+		walk_count(kernel_pml4, KERNEL_VMA, KERNEL_LIM, &walker);
+
+	special = read_tsc() - start;
+	walk_bench_report("specialized walker:", special, count, npages,
+		rounds);
+
+	count = 0;
+	start = read_tsc();
+
+	for (i = 0; i < rounds; ++i)
+		walk_count_present(kernel_pml4, KERNEL_VMA, KERNEL_LIM,
+			&walker);
+
+	special_present = read_tsc() - start;
+	walk_bench_report("specialized present-only:", special_present,
+		count, npages, rounds);
+}
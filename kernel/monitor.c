@@ -27,8 +27,14 @@ static struct command commands[] = {
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 	{ "backtrace", "Display stack backtrace", mon_backtrace },
 	{ "buddyinfo", "Display debugging information for the buddy allocator", mon_buddyinfo },
+	{ "compact", "Compact memory or tune compaction [on|off|max <n>]", mon_compact },
+	{ "kmeminfo", "Display usage of the kernel object caches", mon_kmeminfo },
+	{ "lookupbench", "Measure the cycles per page lookup [pages] [rounds]", mon_lookupbench },
 	{ "pageinfo", "Display page information for a given page index", mon_pageinfo },
 	{ "ptdump", "Display the page tables", mon_ptdump },
+	{ "thp", "Promote pages to huge pages when idle [on|off|batch <n>]", mon_thp },
+	{ "tlbbench", "Measure the TLB refill cost of switches [pages] [rounds]", mon_tlbbench },
+	{ "walkbench", "Measure the cycles per kernel page table walk [rounds]", mon_walkbench },
 };
 
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
@@ -93,9 +99,57 @@ int mon_buddyinfo(int argc, char **argv, struct int_frame *frame)
 	return 0;
 }
 
+int mon_compact(int argc, char **argv, struct int_frame *frame)
+{
+	if (argc == 1) {
+		cprintf("compaction %s\n",
+			compact_memory() == 0 ? "succeeded" : "failed");
+	} else if (strcmp(argv[1], "on") == 0) {
+		compact_on_demand = true;
+	} else if (strcmp(argv[1], "off") == 0) {
+		compact_on_demand = false;
+	} else if (strcmp(argv[1], "max") == 0 && argc > 2) {
+		compact_max_migrate = strtol(argv[2], NULL, 0);
+	} else {
+		cprintf("usage: %s [on|off|max <n>]\n", argv[0]);
+		return 0;
+	}
+
+	show_compact_info();
+
+	return 0;
+}
+
+int mon_kmeminfo(int argc, char **argv, struct int_frame *frame)
+{
+	show_kmem_info();
+
+	return 0;
+}
+
+int mon_lookupbench(int argc, char **argv, struct int_frame *frame)
+{
+	size_t npages = 32, rounds = 1000;
+
+	if (argc > 1)
+		npages = strtol(argv[1], NULL, 0);
+
+	if (argc > 2)
+		rounds = strtol(argv[2], NULL, 0);
+
+	if (npages == 0 || rounds == 0) {
+		cprintf("usage: %s [pages] [rounds]\n", argv[0]);
+		return 0;
+	}
+
+	lookup_benchmark(npages, rounds);
+
+	return 0;
+}
+
 int mon_pageinfo(int argc, char **argv, struct int_frame *frame)
 {
-	struct page_info *page;
+	struct page_info *page, *head;
 	uintptr_t addr;
 	size_t idx;
 
@@ -130,6 +184,16 @@ int mon_pageinfo(int argc, char **argv, struct int_frame *frame)
 
 	cprintf("  Page index: %u\n", idx);
 	cprintf("  Physical address: %p\n", page2pa(page));
+
+	/* Only the first struct page_info of a deferred section is valid. */
+	head = pages + ROUNDDOWN(idx, BUDDY_SECTION_PAGES);
+
+	if (page != head && (head->pp_flags & PP_UNINIT)) {
+		cprintf("  State: uninitialized, see page index %u\n",
+			head - pages);
+		return 0;
+	}
+
 	cprintf("  State: %s\n", page->pp_free ? "free" : "used");
 	cprintf("  References: %u\n", page->pp_ref);
 	cprintf("  Order: %u\n", page->pp_order);
@@ -139,7 +203,71 @@ int mon_pageinfo(int argc, char **argv, struct int_frame *frame)
 
 int mon_ptdump(int argc, char **argv, struct int_frame *frame)
 {
-	return dump_page_tables(kernel_pml4, PAGE_HUGE);
+	int ret = dump_page_tables(kernel_pml4, PAGE_HUGE);
+
+	cprintf("Page table pages in use: %u\n", ptbl_pages);
+
+	return ret;
+}
+
+int mon_thp(int argc, char **argv, struct int_frame *frame)
+{
+	if (argc == 1) {
+		show_thp_info();
+		return 0;
+	}
+
+	if (strcmp(argv[1], "on") == 0) {
+		thp_enabled = true;
+	} else if (strcmp(argv[1], "off") == 0) {
+		thp_enabled = false;
+	} else if (strcmp(argv[1], "batch") == 0 && argc > 2) {
+		thp_scan_batch = strtol(argv[2], NULL, 0);
+	} else {
+		cprintf("usage: %s [on|off|batch <n>]\n", argv[0]);
+		return 0;
+	}
+
+	show_thp_info();
+
+	return 0;
+}
+
+int mon_tlbbench(int argc, char **argv, struct int_frame *frame)
+{
+	size_t npages = 64, rounds = 1000;
+
+	if (argc > 1)
+		npages = strtol(argv[1], NULL, 0);
+
+	if (argc > 2)
+		rounds = strtol(argv[2], NULL, 0);
+
+	if (npages == 0 || rounds == 0) {
+		cprintf("usage: %s [pages] [rounds]\n", argv[0]);
+		return 0;
+	}
+
+	tlb_benchmark(npages, rounds);
+
+	return 0;
+}
+
+int mon_walkbench(int argc, char **argv, struct int_frame *frame)
+{
+	size_t rounds = 100;
+
+	if (argc > 1)
+		rounds = strtol(argv[1], NULL, 0);
+
+	if (rounds == 0) {
+		cprintf("usage: %s [rounds]\n", argv[0]);
+		return 0;
+	}
+
+	walk_benchmark(rounds);
+
+	return 0;
 }
 
 /***** Kernel monitor command interpreter *****/
@@ -199,4 +327,3 @@ void monitor(struct int_frame *frame)
 				break;
 	}
 }
-
@@ -5,7 +5,13 @@
 
 #include <kernel/mem.h>
 
-extern struct list buddy_free_list[];
+extern struct page_list buddy_free_list[][BUDDY_MAX_ORDER];
+extern size_t buddy_free_count[];
+extern uint32_t buddy_free_mask;
+extern size_t buddy_type_count[][BUDDY_MAX_ORDER];
+extern uint32_t buddy_type_mask[];
+extern size_t buddy_zero_count[];
+extern uint32_t buddy_zero_mask;
 
 /* Checks the number of free pages available in both base memory and high
  * memory.
@@ -13,19 +19,19 @@ extern struct list buddy_free_list[];
 void lab1_check_free_list_avail(void)
 {
 	struct page_info *page;
-	struct list *node;
 	size_t order;
+	int type;
 	size_t nfree_basemem = 0;
 	size_t nfree_extmem = 0;
 
-	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
-		list_foreach(buddy_free_list + order, node) {
-			page = container_of(node, struct page_info, pp_node);
-
-			if (page2pa(page) < EXT_PHYS_MEM) {
-				++nfree_basemem;
-			} else {
-				++nfree_extmem;
+	for (type = 0; type < MIGRATE_TYPES; ++type) {
+		for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
+			page_list_foreach(&buddy_free_list[type][order], page) {
+				if (page2pa(page) < EXT_PHYS_MEM) {
+					++nfree_basemem;
+				} else {
+					++nfree_extmem;
+				}
 			}
 		}
 	}
@@ -42,16 +48,16 @@ void lab1_check_free_list_avail(void)
 void lab1_check_free_list_order(void)
 {
 	struct page_info *page;
-	struct list *node;
 	size_t order;
+	int type;
 	size_t nviolations = 0;
 
-	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
-		list_foreach(buddy_free_list + order, node) {
-			page = container_of(node, struct page_info, pp_node);
-
-			if (page->pp_order != order)
-				++nviolations;
+	for (type = 0; type < MIGRATE_TYPES; ++type) {
+		for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
+			page_list_foreach(&buddy_free_list[type][order], page) {
+				if (page->pp_order != order)
+					++nviolations;
+			}
 		}
 	}
 
@@ -101,7 +107,7 @@ void check_buddy_consistency(physaddr_t addr, size_t order, struct page_info *pa
 	page = pa2page(addr);
 
 	if (parent && parent != page) {
-		if (page->pp_free || !list_is_empty(&page->pp_node) ||
+		if (page->pp_free || page_on_list(page) ||
 			page->pp_order < parent->pp_order) {
 			panic("page %p of order %u is free, while parent page "
 				"%p of order %u is already free",
@@ -110,21 +116,25 @@ void check_buddy_consistency(physaddr_t addr, size_t order, struct page_info *pa
 		}
 	}
 
-	if (page->pp_free && list_is_empty(&page->pp_node)) {
+	if (page->pp_free && !page_on_list(page)) {
 		panic("page %p of order %u is free, but not on the free list",
 			page2pa(page), page->pp_order);
 	}
 
-	if (!page->pp_free && !list_is_empty(&page->pp_node)) {
+	if (!page->pp_free && page_on_list(page)) {
 		panic("page %p of order %u is in use, but on the free list",
 			page2pa(page), page->pp_order);
 	}
 
-	if (page->pp_free && list_is_empty(&page->pp_node)) {
+	if (page->pp_free && !page_on_list(page)) {
 		parent = page;
 	}
 
-	if (order == 0) {
+	/* The rest of a section of which the initialization is deferred is
+	 * not valid yet.
+	 */
+	if (order == 0 ||
+	    (order == BUDDY_SECTION_ORDER && (page->pp_flags & PP_UNINIT))) {
 		return;
 	}
 
@@ -137,11 +147,22 @@ void lab1_check_buddy_consistency(void)
 {
 	struct page_info *page;
 	physaddr_t addr;
+	size_t order;
 
+	/* pa2page() panics on pages beyond npages, which chunks of up to 1G
+	 * easily reach. Check every window with the largest order of which
+	 * the chunk lies below npages as a whole, falling back to 2M.
+	 */
 	for (addr = 0;
 	     addr < BOOT_MAP_LIM;
-	     addr += (1 << (BUDDY_MAX_ORDER + 12 - 1))) {
-		check_buddy_consistency(addr, BUDDY_MAX_ORDER - 1, NULL);
+	     addr += (PAGE_SIZE << order)) {
+		for (order = BUDDY_MAX_ORDER - 1; order > BUDDY_2M_PAGE; --order) {
+			if (!(PAGE_INDEX(addr) & (((size_t)1 << order) - 1)) &&
+			    PAGE_INDEX(addr) + ((size_t)1 << order) <= npages)
+				break;
+		}
+
+		check_buddy_consistency(addr, order, NULL);
 	}
 
 	cprintf("[LAB 1] check_buddy_consistency() succeeded!\n");
@@ -149,13 +170,20 @@ void lab1_check_buddy_consistency(void)
 
 void lab1_check_split_and_merge(int flags)
 {
-	struct list stolen_free_list[10];
-	struct page_info *page;
-	size_t order;
+	struct page_list stolen_free_list[MIGRATE_TYPES][BUDDY_MAX_ORDER];
+	size_t stolen_free_count[BUDDY_MAX_ORDER];
+	size_t stolen_zero_count[BUDDY_MAX_ORDER];
+	size_t stolen_type_count[MIGRATE_TYPES][BUDDY_MAX_ORDER];
+	uint32_t stolen_free_mask, stolen_zero_mask;
+	uint32_t stolen_type_mask[MIGRATE_TYPES];
+	struct page_info *page, *buddy = NULL;
+	size_t order, buddy_idx;
+	int type;
 	size_t nfree_pages;
+	uint8_t buddy_free = 0;
 
-	/* Count the number of order 9 pages. */
-	nfree_pages = count_free_pages(BUDDY_2M_PAGE);
+	/* Count the number of free pages. */
+	nfree_pages = count_total_free_pages();
 
 	/* Allocate a order 9 chunk. */
 #ifdef BONUS_LAB1
@@ -169,15 +197,49 @@ void lab1_check_split_and_merge(int flags)
 		panic("can't allocate 2M page!");
 	}
 
-	/* Check against the count of huge pages. */
-	assert(count_free_pages(BUDDY_2M_PAGE) + 1 == nfree_pages);
+	/* Check against the count of free pages. */
+	assert(count_total_free_pages() + ((size_t)1 << BUDDY_2M_PAGE) ==
+		nfree_pages);
+
+	/* The chunk may have been split off a larger chunk, in which case its
+	 * buddy is still free. Hide the buddy, such that the chunk does not
+	 * merge with it while the free lists are stolen.
+	 */
+	buddy_idx = (page - pages) ^ ((size_t)1 << BUDDY_2M_PAGE);
+
+	if (buddy_idx < npages) {
+		buddy = pages + buddy_idx;
+		buddy_free = buddy->pp_free;
+		buddy->pp_free = 0;
+	}
 
 	/* Steal the lists of free pages. */
 	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
-		stolen_free_list[order] = buddy_free_list[order];
-		list_init(buddy_free_list + order);
+		stolen_free_count[order] = buddy_free_count[order];
+		stolen_zero_count[order] = buddy_zero_count[order];
+		buddy_free_count[order] = 0;
+		buddy_zero_count[order] = 0;
 	}
 
+	for (type = 0; type < MIGRATE_TYPES; ++type) {
+		for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
+			stolen_free_list[type][order] =
+				buddy_free_list[type][order];
+			stolen_type_count[type][order] =
+				buddy_type_count[type][order];
+			page_list_init(&buddy_free_list[type][order]);
+			buddy_type_count[type][order] = 0;
+		}
+
+		stolen_type_mask[type] = buddy_type_mask[type];
+		buddy_type_mask[type] = 0;
+	}
+
+	stolen_free_mask = buddy_free_mask;
+	stolen_zero_mask = buddy_zero_mask;
+	buddy_free_mask = 0;
+	buddy_zero_mask = 0;
+
 	/* Return the huge page. */
 	page_free(page);
 
@@ -224,9 +286,27 @@ void lab1_check_split_and_merge(int flags)
 
 	/* Return the lists of free chunks. */
 	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
-		buddy_free_list[order] = stolen_free_list[order];
+		buddy_free_count[order] = stolen_free_count[order];
+		buddy_zero_count[order] = stolen_zero_count[order];
 	}
 
+	for (type = 0; type < MIGRATE_TYPES; ++type) {
+		for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
+			buddy_free_list[type][order] =
+				stolen_free_list[type][order];
+			buddy_type_count[type][order] =
+				stolen_type_count[type][order];
+		}
+
+		buddy_type_mask[type] = stolen_type_mask[type];
+	}
+
+	buddy_free_mask = stolen_free_mask;
+	buddy_zero_mask = stolen_zero_mask;
+
+	if (buddy)
+		buddy->pp_free = buddy_free;
+
 	/* Return the huge page. */
 	page_free(page);
 
@@ -241,6 +321,11 @@ void lab1_check_split_and_merge(int flags)
 
 void lab1_check_mem(struct boot_info *boot_info)
 {
+	bool cache_enabled;
+
+	/* The checks inspect the free lists of the buddy allocator directly. */
+	cache_enabled = page_cache_enable(false);
+
 	lab1_check_free_list_avail();
 	lab1_check_free_list_order();
 	lab1_check_memory_layout(boot_info);
@@ -250,4 +335,5 @@ void lab1_check_mem(struct boot_info *boot_info)
 	lab1_check_split_and_merge(ALLOC_HUGE);
 #endif
 
+	page_cache_enable(cache_enabled);
 }
@@ -6,7 +6,7 @@
 
 #include <kernel/mem.h>
 
-extern struct list buddy_free_list[];
+extern struct page_list buddy_free_list[][BUDDY_MAX_ORDER];
 extern struct page_table *kernel_pml4;
 
 int lab2_do_check_ptbl_flags(physaddr_t *entry, uintptr_t base, uintptr_t end,
@@ -88,6 +88,7 @@ void lab2_check_wx(void)
 	struct page_walker walker = {
 		.pte_callback = lab2_check_pte_wx,
 		.pde_callback = lab2_check_pde_wx,
+		.pdpte_callback = lab2_check_pde_wx,
 	};
 
 	walk_all_pages(kernel_pml4, &walker);
@@ -146,6 +147,7 @@ void lab2_check_vas(void)
 	struct page_walker walker = {
 		.pte_callback = lab2_check_pte_vas,
 		.pde_callback = lab2_check_pde_vas,
+		.pdpte_callback = lab2_check_pde_vas,
 	};
 
 	walk_all_pages(kernel_pml4, &walker);
@@ -243,8 +245,10 @@ void lab2_check_4k_paging(void)
 	/* Remember the amount of free pages. */
 	nfree = count_total_free_pages();
 
-	/* Allocate a 4K page. */
-	page = page_alloc(0);
+	/* Allocate a 4K page. It is only mapped by a PTE, so it can be
+	 * migrated.
+	 */
+	page = page_alloc(ALLOC_MOVABLE);
 
 	if (!page) {
 		panic("cannot allocate 4K page!");
@@ -276,6 +280,81 @@ void lab2_check_4k_paging(void)
 	cprintf("[LAB 2] check_4k_paging() succeeded!\n");
 }
 
+int lab2_check_user_entry(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	size_t *ncalls = walker->udata;
+
+	(void)entry;
+
+	if (base >= USER_LIM || end >= USER_LIM) {
+		panic("present-only walk visited %p outside the user half!\n",
+		    base);
+	}
+
+	++*ncalls;
+
+	return 0;
+}
+
+int lab2_check_user_hole(uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	(void)walker;
+
+	if (base >= USER_LIM || end >= USER_LIM) {
+		panic("present-only walk reported a hole at %p outside the "
+		    "user half!\n", base);
+	}
+
+	return 0;
+}
+
+void lab2_check_present_only_walk(void)
+{
+	struct page_info *page;
+	size_t nfree, ncalls = 0;
+	struct page_walker walker = {
+		.pte_callback = lab2_check_user_entry,
+		.pde_callback = lab2_check_user_entry,
+		.pdpte_callback = lab2_check_user_entry,
+		.pml4e_callback = lab2_check_user_entry,
+		.pt_hole_callback = lab2_check_user_hole,
+		.udata = &ncalls,
+		.present_only = true,
+	};
+
+	/* Remember the amount of free pages. */
+	nfree = count_total_free_pages();
+
+	/* Map a page at the top of the user half, right below the kernel
+	 * half.
+	 */
+	page = page_alloc(ALLOC_MOVABLE);
+
+	if (!page) {
+		panic("cannot allocate 4K page!");
+	}
+
+	assert(page_insert(kernel_pml4, page, (void *)(USER_LIM - PAGE_SIZE),
+	    PAGE_PRESENT) == 0);
+
+	/* The walk has to visit the page at every level, but must not carry on
+	 * into the kernel half.
+	 */
+	walk_user_pages(kernel_pml4, &walker);
+	assert(ncalls >= 4);
+
+	/* Remove the page. */
+	page_remove(kernel_pml4, (void *)(USER_LIM - PAGE_SIZE));
+	assert(page->pp_free);
+
+	/* Check if we leaked memory. */
+	assert(nfree == count_total_free_pages());
+
+	cprintf("[LAB 2] check_present_only_walk() succeeded!\n");
+}
+
 void lab2_check_2m_paging(void)
 {
 	struct page_info *page, *ret;
@@ -321,6 +400,66 @@ void lab2_check_2m_paging(void)
 	cprintf("[LAB 2] check_2m_paging() succeeded!\n");
 }
 
+void lab2_check_1g_paging(void)
+{
+	struct page_info *page, *ret;
+	physaddr_t *entry;
+
+	if (!gpage_supported) {
+		cprintf("[LAB 2] check_1g_paging() skipped, no 1G pages\n");
+		return;
+	}
+
+	/* Allocate a 1G page. */
+	page = page_alloc_order(BUDDY_1G_PAGE, 0);
+
+	if (!page) {
+		cprintf("[LAB 2] check_1g_paging() skipped, out of memory\n");
+		return;
+	}
+
+	/* Misaligned insert should fail. */
+	assert(page_insert(kernel_pml4, page, (void *)HPAGE_SIZE, PAGE_PRESENT) != 0);
+
+	/* Insert the page. */
+	assert(page_insert(kernel_pml4, page, 0, PAGE_PRESENT) == 0);
+	assert(page->pp_ref == 1);
+	assert(!page->pp_free);
+
+	/* Look up the page at both ends. */
+	ret = page_lookup(kernel_pml4, 0, &entry);
+	assert((*entry & PAGE_MASK) == (PAGE_PRESENT | PAGE_HUGE));
+	assert(PAGE_ADDR(*entry) == page2pa(page));
+	assert(ret == page);
+
+	ret = page_lookup(kernel_pml4, (void *)(GPAGE_SIZE - PAGE_SIZE), &entry);
+	assert(ret == page);
+
+	/* Remove the second 2M page, which splits up the 1G page. */
+	unmap_page_range(kernel_pml4, (void *)HPAGE_SIZE, HPAGE_SIZE);
+	assert(!page_lookup(kernel_pml4, (void *)HPAGE_SIZE, NULL));
+	assert(page[1 << BUDDY_2M_PAGE].pp_free);
+
+	ret = page_lookup(kernel_pml4, 0, &entry);
+	assert((*entry & PAGE_MASK) == (PAGE_PRESENT | PAGE_HUGE));
+	assert(ret == page);
+	assert(page->pp_order == BUDDY_2M_PAGE);
+
+	ret = page_lookup(kernel_pml4, (void *)(2 * HPAGE_SIZE), NULL);
+	assert(ret == page + (2 << BUDDY_2M_PAGE));
+
+	/* Remove the rest, such that the 1G chunk merges again. */
+	unmap_page_range(kernel_pml4, 0, GPAGE_SIZE);
+	assert(!page_lookup(kernel_pml4, 0, NULL));
+	assert(page->pp_free);
+	assert(page->pp_order >= BUDDY_1G_PAGE);
+
+	/* Check if the page tables have been cleaned up. */
+	assert(kernel_pml4->entries[0] == 0);
+
+	cprintf("[LAB 2] check_1g_paging() succeeded!\n");
+}
+
 int ismemset(void *s, int c, size_t n)
 {
 	unsigned char *p = s;
@@ -396,7 +535,7 @@ void lab2_check_transparent_2m_paging(void)
 			page = pa2page(PAGE_ADDR(*entry));
 			assert(page->pp_order == 0);
 			assert(!page->pp_free);
-			assert(list_is_empty(&page->pp_node));
+			assert(!page_on_list(page));
 
 			if (!ismemset(addr, (i & 0xff), PAGE_SIZE)) {
 				panic("page %p is corrupt", addr);
@@ -404,8 +543,10 @@ void lab2_check_transparent_2m_paging(void)
 		}
 	}
 
-	/* Allocate a 4K page. */
-	page = page_alloc(0);
+	/* Allocate a 4K page. It is only mapped by a PTE, so it can be
+	 * migrated.
+	 */
+	page = page_alloc(ALLOC_MOVABLE);
 
 	if (!page) {
 		panic("cannot allocate 4K page!");
@@ -449,19 +590,115 @@ void lab2_check_transparent_2m_paging(void)
 /* Checks if the order of the free pages on the free list for the respective
  * order matches.
  */
+/* Runs thp_idle() until it promotes a page table, or gives up after scanning
+ * the user address space a few times.
+ */
+size_t lab2_thp_promote(void)
+{
+	size_t i;
+
+	for (i = 0; i < 4096; ++i) {
+		if (thp_idle())
+			return 1;
+	}
+
+	return 0;
+}
+
+void lab2_check_thp(void)
+{
+	struct page_info *page, *ret;
+	physaddr_t *entry;
+	uintptr_t va = 4 * HPAGE_SIZE;
+	size_t i, nfree, ndemoted;
+	bool enabled;
+
+	/* Remember the amount of free pages. */
+	nfree = count_total_free_pages();
+	enabled = thp_enabled;
+	thp_enabled = true;
+
+	/* Map 512 movable pages in a 2M aligned range. */
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		page = page_alloc(ALLOC_MOVABLE);
+
+		if (!page) {
+			panic("cannot allocate 4K page!");
+		}
+
+		assert(page_insert(kernel_pml4, page,
+		    (void *)(va + i * PAGE_SIZE), PAGE_PRESENT | PAGE_WRITE) == 0);
+	}
+
+	/* The page table should get promoted to a 2M page. */
+	assert(lab2_thp_promote());
+
+	ret = page_lookup(kernel_pml4, (void *)va, &entry);
+	assert(*entry & PAGE_HUGE);
+	assert(ret == pa2page(PAGE_ADDR(*entry)));
+	assert(ret->pp_ref == 1);
+	assert(ret->pp_order == BUDDY_2M_PAGE);
+
+	/* Remove the page. */
+	assert(unmap_page_range(kernel_pml4, (void *)va, HPAGE_SIZE) == 0);
+	assert(ret->pp_free);
+	assert(nfree == count_total_free_pages());
+
+	/* Map a 2M page and split it up by remapping one of its 4K pages. */
+	page = page_alloc(ALLOC_HUGE | ALLOC_MOVABLE);
+
+	if (!page) {
+		panic("cannot allocate 2M page!");
+	}
+
+	assert(page_insert(kernel_pml4, page, (void *)va,
+	    PAGE_PRESENT | PAGE_WRITE) == 0);
+	ndemoted = thp_ndemoted;
+	assert(page_insert(kernel_pml4, page + 1, (void *)(va + PAGE_SIZE),
+	    PAGE_PRESENT | PAGE_WRITE) == 0);
+	assert(thp_ndemoted == ndemoted + 1);
+	assert(page->pp_order == BUDDY_4K_PAGE);
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i)
+		assert(page[i].pp_ref == 1);
+
+	/* The pages are still contiguous, so they are promoted in place. */
+	assert(lab2_thp_promote());
+
+	ret = page_lookup(kernel_pml4, (void *)va, &entry);
+	assert(*entry & PAGE_HUGE);
+	assert(ret == page);
+	assert(page->pp_ref == 1);
+	assert(page->pp_order == BUDDY_2M_PAGE);
+
+	/* Remove the page. */
+	assert(unmap_page_range(kernel_pml4, (void *)va, HPAGE_SIZE) == 0);
+	assert(page->pp_free);
+
+	/* Check if the page tables have been cleaned up. */
+	assert(kernel_pml4->entries[0] == 0);
+
+	/* Check if we leaked memory. */
+	assert(nfree == count_total_free_pages());
+
+	thp_enabled = enabled;
+
+	cprintf("[LAB 2] check_thp() succeeded!\n");
+}
+
 void lab2_check_free_list_order(void)
 {
 	struct page_info *page;
-	struct list *node;
 	size_t order;
+	int type;
 	size_t nviolations = 0;
 
-	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
-		list_foreach(buddy_free_list + order, node) {
-			page = container_of(node, struct page_info, pp_node);
-
-			if (page->pp_order != order)
-				++nviolations;
+	for (type = 0; type < MIGRATE_TYPES; ++type) {
+		for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
+			page_list_foreach(&buddy_free_list[type][order], page) {
+				if (page->pp_order != order)
+					++nviolations;
+			}
 		}
 	}
 
@@ -475,7 +712,7 @@ void lab2_check_free_list_order(void)
 void lab2_check_memory_layout(struct boot_info *boot_info)
 {
 	struct mmap_entry *entry;
-	struct page_info *page;
+	struct page_info *page, *head;
 	size_t i;
 	physaddr_t pa, end;
 	void *addr;
@@ -497,6 +734,16 @@ void lab2_check_memory_layout(struct boot_info *boot_info)
 				continue;
 			}
 
+			/* Only the first struct page_info of a section of
+			 * which the initialization is deferred is valid.
+			 */
+			head = pages + ROUNDDOWN(PAGE_INDEX(pa),
+				BUDDY_SECTION_PAGES);
+
+			if (page != head && (head->pp_flags & PP_UNINIT)) {
+				continue;
+			}
+
 			if ((pa == 0 ||
 			    pa == (uintptr_t)boot_info->elf_hdr ||
 			    (KERNEL_LMA <= pa && pa < end) ||
@@ -520,12 +767,12 @@ void lab2_check_buddy_consistency(void)
 
 	for (addr = 0;
 	     addr < npages * PAGE_SIZE;
-	     addr += (1 << (BUDDY_MAX_ORDER + 12 - 1))) {
+	     addr += (PAGE_SIZE << BUDDY_2M_PAGE)) {
 		if (!page_lookup(kernel_pml4, pa2page(addr), NULL)) {
 			continue;
 		}
 
-		check_buddy_consistency(addr, BUDDY_MAX_ORDER - 1, NULL);
+		check_buddy_consistency(addr, BUDDY_2M_PAGE, NULL);
 	}
 
 	cprintf("[LAB 2] check_buddy_consistency() succeeded!\n");
@@ -550,10 +797,10 @@ void lab2_check_buddy_full_consistency(void)
                 }
 
                 // check consistency of the buddy metadata page
-		check_buddy_consistency(addr, BUDDY_MAX_ORDER - 1, NULL);
+		check_buddy_consistency(addr, BUDDY_2M_PAGE, NULL);
 
                 // check consistency of the actual page.
-                check_buddy_consistency(PADDR(KADDR(addr)), BUDDY_MAX_ORDER - 1, NULL);
+                check_buddy_consistency(PADDR(KADDR(addr)), BUDDY_2M_PAGE, NULL);
 	}
 
 	cprintf("[LAB 2] check_buddy_full_consistency() succeeded!\n");
@@ -568,15 +815,28 @@ void lab2_check_pml4(void)
 
 void lab2_check_paging(void)
 {
+	bool cache_enabled;
+
+	/* The checks expect freed pages to be returned to the buddy allocator. */
+	cache_enabled = page_cache_enable(false);
+
 	lab2_check_4k_paging();
+	lab2_check_present_only_walk();
+	lab2_check_thp();
         /** BONUS
 	lab2_check_2m_paging();
 	lab2_check_transparent_2m_paging();
         **/
+
+	page_cache_enable(cache_enabled);
 }
 
 void lab2_check_buddy(struct boot_info *boot_info)
 {
+	bool cache_enabled;
+
+	cache_enabled = page_cache_enable(false);
+
 	lab2_check_free_list_order();
 	lab2_check_memory_layout(boot_info);
 	lab2_check_buddy_consistency();
@@ -584,8 +844,11 @@ void lab2_check_buddy(struct boot_info *boot_info)
         lab2_check_buddy_full_consistency();
 #endif
 	lab2_check_vas();
+	lab2_check_1g_paging();
 
 #ifdef EXTENDED_CHECKS_LAB2
         lab2_check_vas_ext();
 #endif
+
+	page_cache_enable(cache_enabled);
 }
@@ -1,7 +1,9 @@
-/* Basic string routines.  Not hardware optimized, but not shabby. */
+/* Basic string routines, tuned to the string instructions of the CPU. */
 
 #include <string.h>
 
+#include <x86-64/asm.h>
+
 /*
  * Using assembly for memset/memmove makes some difference on real hardware,
  * but it makes an even bigger difference on bochs.
@@ -113,22 +115,99 @@ char *strfind(const char *s, char c)
 }
 
 #if ASM
+enum {
+	/* Enhanced rep movsb/stosb: the byte variants are the fastest ones. */
+	STRING_ERMS = 1 << 0,
+	/* SSE2 non-temporal stores (movnti) that bypass the caches. */
+	STRING_NT = 1 << 1,
+};
+
+/* The STRING_* features of the CPU, as detected by string_init(). */
+static int string_features;
+
+/*
+ * Detects the CPU features that memset() and memmove() can make use of. Until
+ * this has been called, the routines below stick to 8-byte string
+ * instructions, which work on any x86-64 CPU.
+ */
+void string_init(void)
+{
+	uint32_t max, ebx, edx;
+
+	cpuid(0, &max, NULL, NULL, NULL);
+	cpuid(1, NULL, NULL, NULL, &edx);
+
+	if (edx & (1 << 26))
+		string_features |= STRING_NT;
+
+	if (max >= 7) {
+		cpuid_count(7, 0, NULL, &ebx, NULL, NULL);
+
+		if (ebx & (1 << 9))
+			string_features |= STRING_ERMS;
+	}
+}
+
+static void rep_stosb(void *p, int c, size_t n)
+{
+	asm volatile("cld; rep stosb\n"
+		: "+D" (p), "+c" (n) : "a" (c) : "cc", "memory");
+}
+
+static void rep_stosq(void *p, uint64_t c, size_t n)
+{
+	asm volatile("cld; rep stosq\n"
+		: "+D" (p), "+c" (n) : "a" (c) : "cc", "memory");
+}
+
+static void rep_movsb(void *d, const void *s, size_t n)
+{
+	asm volatile("cld; rep movsb\n"
+		: "+D" (d), "+S" (s), "+c" (n) :: "cc", "memory");
+}
+
+static void rep_movsq(void *d, const void *s, size_t n)
+{
+	asm volatile("cld; rep movsq\n"
+		: "+D" (d), "+S" (s), "+c" (n) :: "cc", "memory");
+}
+
+/* Like rep_movsb() and rep_movsq(), but d and s point to the last unit. */
+static void rep_movsb_back(void *d, const void *s, size_t n)
+{
+	/* Some versions of GCC rely on DF being clear. */
+	asm volatile("std; rep movsb; cld\n"
+		: "+D" (d), "+S" (s), "+c" (n) :: "cc", "memory");
+}
+
+static void rep_movsq_back(void *d, const void *s, size_t n)
+{
+	asm volatile("std; rep movsq; cld\n"
+		: "+D" (d), "+S" (s), "+c" (n) :: "cc", "memory");
+}
+
 void *memset(void *v, int c, size_t n)
 {
-	char *p;
+	char *p = v;
+	size_t head;
 
 	if (n == 0)
 		return v;
-	if ((uintptr_t)v%4 == 0 && n%4 == 0) {
-		c &= 0xFF;
-		c = (c<<24)|(c<<16)|(c<<8)|c;
-		asm volatile("cld; rep stosl\n"
-			:: "D" (v), "a" (c), "c" (n/4)
-			: "cc", "memory");
-	} else
-		asm volatile("cld; rep stosb\n"
-			:: "D" (v), "a" (c), "c" (n)
-			: "cc", "memory");
+
+	if (string_features & STRING_ERMS) {
+		rep_stosb(p, c, n);
+		return v;
+	}
+
+	/* Align the destination, then store 8 bytes at a time. */
+	head = MIN(-(uintptr_t)p & 7, n);
+	rep_stosb(p, c, head);
+	p += head;
+	n -= head;
+
+	rep_stosq(p, (uint8_t)c * UINT64_C(0x0101010101010101), n / 8);
+	rep_stosb(p + (n & ~7), c, n & 7);
+
 	return v;
 }
 
@@ -136,28 +215,105 @@ void *memmove(void *dst, const void *src, size_t n)
 {
 	const char *s;
 	char *d;
+	size_t head;
 
 	s = src;
 	d = dst;
+	if (n == 0 || s == d)
+		return dst;
+
 	if (s < d && s + n > d) {
-		s += n;
-		d += n;
-		if ((uintptr_t)s%4 == 0 && (uintptr_t)d%4 == 0 && n%4 == 0)
-			asm volatile("std; rep movsl\n"
-				:: "D" (d-4), "S" (s-4), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("std; rep movsb\n"
-				:: "D" (d-1), "S" (s-1), "c" (n) : "cc", "memory");
-		/* Some versions of GCC rely on DF being clear. */
-		asm volatile("cld" ::: "cc");
-	} else {
-		if ((uintptr_t)s%4 == 0 && (uintptr_t)d%4 == 0 && n%4 == 0)
-			asm volatile("cld; rep movsl\n"
-				:: "D" (d), "S" (s), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("cld; rep movsb\n"
-				:: "D" (d), "S" (s), "c" (n) : "cc", "memory");
+		/* Copy backwards, starting with the bytes past the last aligned
+		 * word of the destination.
+		 */
+		head = MIN((uintptr_t)(d + n) & 7, n);
+		rep_movsb_back(d + n - 1, s + n - 1, head);
+		n -= head;
+
+		rep_movsq_back(d + n - 8, s + n - 8, n / 8);
+		rep_movsb_back(d + (n & 7) - 1, s + (n & 7) - 1, n & 7);
+
+		return dst;
+	}
+
+	if (string_features & STRING_ERMS) {
+		rep_movsb(d, s, n);
+		return dst;
+	}
+
+	head = MIN(-(uintptr_t)d & 7, n);
+	rep_movsb(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+
+	rep_movsq(d, s, n / 8);
+	rep_movsb(d + (n & ~7), s + (n & ~7), n & 7);
+
+	return dst;
+}
+
+/*
+ * Like memset(), but uses non-temporal stores where possible, such that
+ * clearing a large buffer does not evict everything else from the caches.
+ */
+void *memset_nt(void *v, int c, size_t n)
+{
+	uint64_t c8 = (uint8_t)c * UINT64_C(0x0101010101010101);
+	uint64_t *p = v;
+	size_t body = 0;
+
+	if ((string_features & STRING_NT) && !((uintptr_t)v & 7)) {
+		body = n & ~31;
+
+		for (; p < (uint64_t *)((char *)v + body); p += 4)
+			asm volatile(
+				"movnti %1, 0(%0)\n"
+				"movnti %1, 8(%0)\n"
+				"movnti %1, 16(%0)\n"
+				"movnti %1, 24(%0)\n"
+				:: "r" (p), "r" (c8) : "memory");
+
+		/* Order the non-temporal stores before any later stores. */
+		asm volatile("sfence" ::: "memory");
+	}
+
+	memset((char *)v + body, c, n - body);
+
+	return v;
+}
+
+/*
+ * Like memcpy(), but uses non-temporal stores where possible. The buffers may
+ * not overlap.
+ */
+void *memcpy_nt(void *dst, const void *src, size_t n)
+{
+	uint64_t *d = dst;
+	const uint64_t *s = src;
+	uint64_t tmp;
+	size_t body = 0;
+
+	if ((string_features & STRING_NT) && !((uintptr_t)dst & 7)) {
+		body = n & ~31;
+
+		for (; d < (uint64_t *)((char *)dst + body); d += 4, s += 4)
+			asm volatile(
+				"movq 0(%2), %0\n"
+				"movnti %0, 0(%1)\n"
+				"movq 8(%2), %0\n"
+				"movnti %0, 8(%1)\n"
+				"movq 16(%2), %0\n"
+				"movnti %0, 16(%1)\n"
+				"movq 24(%2), %0\n"
+				"movnti %0, 24(%1)\n"
+				: "=&r" (tmp) : "r" (d), "r" (s) : "memory");
+
+		asm volatile("sfence" ::: "memory");
 	}
+
+	memmove((char *)dst + body, (const char *)src + body, n - body);
+
 	return dst;
 }
 
@@ -194,6 +350,20 @@ void *memmove(void *dst, const void *src, size_t n)
 
 	return dst;
 }
+
+void string_init(void)
+{
+}
+
+void *memset_nt(void *v, int c, size_t n)
+{
+	return memset(v, c, n);
+}
+
+void *memcpy_nt(void *dst, const void *src, size_t n)
+{
+	return memmove(dst, src, n);
+}
 #endif
 
 void *memcpy(void *dst, const void *src, size_t n)
@@ -203,9 +373,14 @@ void *memcpy(void *dst, const void *src, size_t n)
 
 int memcmp(const void *v1, const void *v2, size_t n)
 {
+	typedef uint64_t __attribute__((may_alias, aligned(1))) word_t;
 	const uint8_t *s1 = (const uint8_t *) v1;
 	const uint8_t *s2 = (const uint8_t *) v2;
 
+	/* Skip the words that are equal, then find the byte that differs. */
+	while (n >= 8 && *(const word_t *)s1 == *(const word_t *)s2)
+		s1 += 8, s2 += 8, n -= 8;
+
 	while (n-- > 0) {
 		if (*s1 != *s2)
 			return (int) *s1 - (int) *s2;